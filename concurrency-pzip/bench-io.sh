@@ -0,0 +1,61 @@
+#! /bin/bash
+
+# compares the pzip -m io modes on one generated input file, both with the
+# file dropped from the page cache before each run (cold) and with it already
+# cached (warm). dropping a single file's pages uses GNU dd's nocache flag, so
+# no root is needed.
+#
+# usage: ./bench-io.sh [size in MB] [runs per mode]
+
+size_mb=${1:-1024}
+runs=${2:-3}
+file=bench-io.in
+
+if ! [[ -x pzip ]]; then
+    echo "pzip executable does not exist"
+    exit 1
+fi
+
+# runs of random length of random letters, like tests/filegen.py makes.
+# one random MB is repeated, which is plenty for measuring io.
+if [[ ! -f $file ]] || (( $(stat -c %s $file) != size_mb * 1048576 )); then
+    echo "generating ${size_mb}MB of input in $file"
+    python3 - $file $size_mb <<'PY'
+import random, sys
+random.seed(0)
+block = bytearray()
+while len(block) < 1 << 20:
+    block += bytes([random.choice(b'abcdefghijklmnopqrstuvwxyz\n')]) * random.randint(1, 20)
+with open(sys.argv[1], 'wb') as f:
+    for _ in range(int(sys.argv[2])):
+        f.write(block[:1 << 20])
+PY
+fi
+
+drop_cache () {
+    dd if=$file iflag=nocache count=0 status=none
+}
+
+# time_run mode: prints the MB/s of one run
+time_run () {
+    local start=$(date +%s.%N)
+    ./pzip -m $1 $file > /dev/null
+    local end=$(date +%s.%N)
+    echo "$size_mb $start $end" | awk '{ printf "%.1f", $1 / ($3 - $2) }'
+}
+
+printf "%-10s %-6s %s\n" mode cache "MB/s per run"
+for mode in mmap advise populate read; do
+    for cache in cold warm; do
+        results=""
+        for (( i = 0; i < runs; i++ )); do
+            if [[ $cache == cold ]]; then
+                drop_cache
+            else
+                cat $file > /dev/null
+            fi
+            results="$results $(time_run $mode)"
+        done
+        printf "%-10s %-6s%s\n" $mode $cache "$results"
+    done
+done
@@ -0,0 +1,114 @@
+#! /bin/bash
+
+# measures pzip and wunzip on generated inputs with different run lengths:
+#   random: random bytes, so nearly every run is 1 long
+#   text:   English-like words and punctuation, runs of 1 to 3
+#   runs:   long runs of a few thousand to a few hundred thousand bytes
+#   mixed:  run lengths spread from 1 up to thousands
+# for every input and output format (plain, -c and -e) it reports the
+# compression ratio, then the MB/s of both tools at each thread count. the MB/s
+# are always per MB of uncompressed data, and the best of the runs is kept.
+#
+# usage: ./bench.sh [size in MB] [runs] [thread counts ...]
+# the thread counts default to 1, 2, 4, ... up to the number of cores.
+# the inputs are kept as bench-*.in and only remade when the size changes.
+
+size_mb=${1:-256}
+runs=${2:-3}
+shift $(( $# < 2 ? $# : 2 ))
+threads="$*"
+wunzip=../initial-utilities/wunzip/wunzip
+
+if (( size_mb < 1 )); then
+    echo "size must be at least 1MB"
+    exit 1
+fi
+
+if ! [[ -x pzip ]]; then
+    echo "pzip executable does not exist"
+    exit 1
+fi
+if ! [[ -x $wunzip ]]; then
+    echo "wunzip executable does not exist"
+    exit 1
+fi
+
+if [[ -z $threads ]]; then
+    cores=$(nproc)
+    for (( t = 1; t < cores; t *= 2 )); do
+        threads="$threads $t"
+    done
+    threads="$threads $cores"
+fi
+
+# one 16MB block of each kind is made and repeated, which keeps generating
+# tens of GB quick. 16MB is more than any chunk, so the repeats don't line up
+# with chunk boundaries.
+generate () {
+    python3 - $1 $2 <<'PY'
+import random, sys
+kind, size_mb = sys.argv[1], int(sys.argv[2])
+random.seed(0)
+block_size = min(16, size_mb) << 20
+block = bytearray()
+if kind == 'random':
+    block = bytearray(random.randbytes(block_size))
+elif kind == 'text':
+    words = ('the of and to a in is it you that he was for on are with as his they '
+             'be at one have this from or had by hot word but what some we can out '
+             'other were all there when up use your how said an each she which do '
+             'their time if will way about many then them write would like so these '
+             'her long make thing see him two has look more day could go come did '
+             'number sound no most people my over know water than call first who '
+             'may down side been now find little letter off all green soon tree '
+             'bookkeeper committee address coffee balloon success mississippi').split()
+    while len(block) < block_size:
+        sentence = ' '.join(random.choice(words) for _ in range(random.randint(4, 20)))
+        block += (sentence.capitalize() + random.choice(['. ', '. ', '? ', '!\n', '.\n\n'])).encode()
+elif kind == 'runs':
+    while len(block) < block_size:
+        block += bytes([random.choice(b'abcdefghijklmnopqrstuvwxyz')]) * random.randint(4096, 262144)
+elif kind == 'mixed':
+    while len(block) < block_size:
+        block += bytes([random.getrandbits(8)]) * min(int(random.paretovariate(0.8)), 65536)
+block = block[:block_size]
+with open('bench-%s.in' % kind, 'wb') as f:
+    for _ in range((size_mb << 20) // block_size):
+        f.write(block)
+    f.write(block[:(size_mb << 20) % block_size])
+PY
+}
+
+# best_rate command...: prints the best MB/s over the runs of the command
+best_rate () {
+    local best=0
+    for (( i = 0; i < runs; i++ )); do
+        local start=$(date +%s.%N)
+        "$@" > /dev/null
+        local end=$(date +%s.%N)
+        best=$(echo "$size_mb $start $end $best" | awk '{ r = $1 / ($3 - $2); printf "%.1f", (r > $4 ? r : $4) }')
+    done
+    echo $best
+}
+
+printf "%-7s %-6s %-7s %-8s %-10s %s\n" input format ratio threads "pzip MB/s" "wunzip MB/s"
+for kind in random text runs mixed; do
+    file=bench-$kind.in
+    if [[ ! -f $file ]] || (( $(stat -c %s $file) != size_mb * 1048576 )); then
+        echo "generating ${size_mb}MB of $kind input in $file"
+        generate $kind $size_mb
+    fi
+    for format in plain -c -e; do
+        flags=""
+        if [[ $format != plain ]]; then
+            flags=$format
+        fi
+        ./pzip $flags $file > bench.z
+        ratio=$(echo "$(stat -c %s $file) $(stat -c %s bench.z)" | awk '{ printf "%.2f", $1 / ($2 > 0 ? $2 : 1) }')
+        for t in $threads; do
+            printf "%-7s %-6s %-7s %-8s %-10s %s\n" $kind $format $ratio $t \
+                $(best_rate ./pzip -t $t $flags $file) $(best_rate $wunzip -t $t bench.z)
+        done
+    done
+done
+rm -f bench.z
@@ -1,7 +1,9 @@
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,10 +11,77 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define NUM_CORES (4) // you're supposed to use the get_nprocs function, but MacOS doesn't have that.
+#define DEFAULT_NUM_THREADS (4) // used if sysconf can't tell us the number of cores. MacOS doesn't have get_nprocs.
+#define CHUNKS_PER_THREAD (4)
+#define MIN_CHUNK_SIZE (1 << 16)
+#define MAX_CHUNK_SIZE (1 << 22)
+#define STREAM_BLOCK_SIZE (1 << 20)
+#define BLOCKS_PER_THREAD (2)
+#define HUGE_PAGE_SIZE (1 << 21)
+
+// the indexed format (-i K) wraps the usual records in a header and a footer:
+//   magic, uint32 K
+//   records (4-byte count + 1 char each, same as without -i)
+//   end of records marker: a record with a count of -1 and char 0
+//   index entries: (uint64 uncompressed offset, uint64 compressed offset)
+//                  of record 0, K, 2K, ...
+//   uint64 number of index entries, uint64 uncompressed size, magic
+// the last byte of the magic has its high bit set, so read as a count it is
+// negative and can never be mistaken for the start of a plain record stream.
+// this has to match wunzip.c
+#define INDEXED_MAGIC "WZI\x89"
+#define MAGIC_SIZE (4)
+#define RECORD_SIZE (5)
+#define INDEXED_END_COUNT (-1)
+
+// the entropy coded format (-e). every chunk is coded on its own by the
+// thread that compressed it:
+//   1. its records become a byte string: the char, then the count as a LEB128
+//      varint (7 bits per byte, high bit set on every byte but the last)
+//   2. those bytes get a Huffman code built just for this chunk
+// the output is the magic, then one block per chunk:
+//   uint32 coded size, uint32 varint bytes, uint64 uncompressed size,
+//   code lengths of all 256 byte values packed 4 bits each (0 if unused),
+//   the coded bits, most significant first, padded out to a whole byte
+// runs are not joined across chunks, which only costs a record per chunk.
+// this has to match wunzip.c
+#define ENTROPY_MAGIC "WZH\x89"
+#define MAX_CODE_LEN (12)
+#define ENTROPY_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t) + 128)
+
+// the compact format (-c) is the magic followed by tokens. each token starts
+// with a LEB128 varint h:
+//   h even: a run of h >> 1 copies of the byte after it
+//   h odd:  h >> 1 literal bytes follow, to be copied as they are
+// runs shorter than COMPACT_MIN_RUN are folded into the literals, so text with
+// few repeats costs a little over a byte per byte instead of five.
+// this has to match wunzip.c
+#define COMPACT_MAGIC "WZV\x89"
+#define COMPACT_MIN_RUN (3)
+#define MAX_LITERAL_LEN (1 << 16)
+#define MAX_VARINT_SIZE (10)
 
 bool is_verbose = false;
 
+// how mapped inputs get into memory (-m)
+//   mmap:     plain mmap, pages are faulted in one at a time as threads touch them
+//   advise:   mmap, then MADV_SEQUENTIAL and MADV_WILLNEED so the kernel reads ahead
+//   populate: mmap with MAP_POPULATE, so every page is read in before we start
+//   read:     read() the file into an anonymous buffer backed by huge pages
+//             (MAP_HUGETLB if there are any reserved, else MADV_HUGEPAGE)
+// the flags that a platform doesn't have are skipped.
+typedef enum io_mode_t {
+  IO_MMAP,
+  IO_ADVISE,
+  IO_POPULATE,
+  IO_READ,
+} io_mode_t;
+
+char *io_mode_names[] = { "mmap", "advise", "populate", "read" };
+io_mode_t io_mode = IO_MMAP;
+bool is_entropy_coded = false;
+bool is_compact = false;
+
 // Helper functions
 void print_verbose(char *fmt, ...) {
   if (is_verbose) {
@@ -97,22 +166,6 @@ void state_add(state_t *this, int num_chars, char c) {
   this->index++;
 }
 
-void state_merge(state_t *dst, state_t *src) {
-  if (src->index == 0) {
-    return; // just in case this gets called with an empty state_t
-  }
-  int i;
-  if (dst->chars_arr[dst->index-1] == src->chars_arr[0]) {
-    dst->num_chars_arr[dst->index-1] += src->num_chars_arr[0];
-    i = 1;
-  } else {
-    i = 0;
-  }
-  for (; i < src->index; i++) {
-    state_add(dst, src->num_chars_arr[i], src->chars_arr[i]);
-  }
-}
-
 void state_free(state_t *this) {
   free(this->num_chars_arr);
   free(this->chars_arr);
@@ -130,128 +183,855 @@ void state_print(state_t *this) {
   printf("\n");
 }
 
-// stuff for the threads
-typedef struct thread_args_t {
-  int start_index;
-  int end_index;
+// appends the runs in text[0, len) to the state. if text starts with the
+// same char the state ended with, that run is continued instead. a run
+// longer than INT_MAX is split, as the count is an int.
+void compress_text(char *text, size_t len, state_t *state) {
+  if (len == 0) {
+    return;
+  }
+  char curr_char = text[0];
+  int num_chars = 0;
+  if (state->index > 0 && state->chars_arr[state->index - 1] == curr_char) {
+    state->index--;
+    num_chars = state->num_chars_arr[state->index];
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (text[i] != curr_char || num_chars == INT_MAX) {
+      state_add(state, num_chars, curr_char);
+      num_chars = 0;
+      curr_char = text[i];
+    }
+    num_chars++;
+  }
+  state_add(state, num_chars, curr_char);
+}
+
+// entropy coding (-e)
+
+// a growable byte buffer for a coded chunk
+typedef struct buffer_t {
+  char *data;
+  size_t len;
+  size_t size;
+} buffer_t;
+
+void buffer_init(buffer_t *this) {
+  this->data = NULL;
+  this->len = 0;
+  this->size = 0;
+}
+
+void buffer_reserve(buffer_t *this, size_t size) {
+  if (this->size < size) {
+    free(this->data);
+    this->size = size;
+    this->data = (char *) malloc_or_die(size, "coded buffer of size %zu", size);
+  }
+}
+
+void buffer_free(buffer_t *this) {
+  free(this->data);
+}
+
+// fills lens with Huffman code lengths for the byte values with nonzero
+// freqs. if the tree comes out deeper than MAX_CODE_LEN, the freqs are
+// flattened and it's built again. 256 symbols is few enough that picking the
+// two lightest nodes with a linear scan is fine.
+void huffman_lengths(uint64_t *freqs, uint8_t *lens) {
+  uint64_t weights[511];
+  int parents[511];
+  uint64_t flat[256];
+  memcpy(flat, freqs, sizeof(flat));
+  while (true) {
+    int num_nodes = 0;
+    int num_leaves = 0;
+    for (int sym = 0; sym < 256; sym++) {
+      weights[sym] = flat[sym];
+      parents[sym] = -1;
+      num_leaves += flat[sym] > 0;
+    }
+    num_nodes = 256;
+    memset(lens, 0, 256);
+    if (num_leaves == 1) {
+      for (int sym = 0; sym < 256; sym++) {
+        lens[sym] = flat[sym] > 0;
+      }
+      return;
+    }
+    for (int joins = 0; joins < num_leaves - 1; joins++) {
+      int a = -1;
+      int b = -1;
+      for (int n = 0; n < num_nodes; n++) {
+        if (weights[n] == 0 || parents[n] != -1) {
+          continue;
+        }
+        if (a == -1 || weights[n] < weights[a]) {
+          b = a;
+          a = n;
+        } else if (b == -1 || weights[n] < weights[b]) {
+          b = n;
+        }
+      }
+      weights[num_nodes] = weights[a] + weights[b];
+      parents[num_nodes] = -1;
+      parents[a] = num_nodes;
+      parents[b] = num_nodes;
+      num_nodes++;
+    }
+    int max_len = 0;
+    for (int sym = 0; sym < 256; sym++) {
+      if (flat[sym] == 0) {
+        continue;
+      }
+      int len = 0;
+      for (int n = sym; parents[n] != -1; n = parents[n]) {
+        len++;
+      }
+      lens[sym] = len;
+      max_len = len > max_len ? len : max_len;
+    }
+    if (max_len <= MAX_CODE_LEN) {
+      return;
+    }
+    for (int sym = 0; sym < 256; sym++) {
+      flat[sym] = flat[sym] > 0 ? (flat[sym] >> 1) | 1 : 0;
+    }
+  }
+}
+
+// canonical codes from code lengths, the same way deflate does it, so only
+// the lengths have to be stored
+void canonical_codes(uint8_t *lens, uint16_t *codes) {
+  int len_counts[MAX_CODE_LEN + 1] = { 0 };
+  for (int sym = 0; sym < 256; sym++) {
+    if (lens[sym] > 0) {
+      len_counts[lens[sym]]++;
+    }
+  }
+  uint16_t next_code[MAX_CODE_LEN + 1];
+  uint16_t code = 0;
+  for (int len = 1; len <= MAX_CODE_LEN; len++) {
+    code = (code + len_counts[len - 1]) << 1;
+    next_code[len] = code;
+  }
+  for (int sym = 0; sym < 256; sym++) {
+    if (lens[sym] > 0) {
+      codes[sym] = next_code[lens[sym]]++;
+    }
+  }
+}
+
+// codes the records of state as one block (see the top of the file)
+void entropy_encode(state_t *state, buffer_t *out) {
+  out->len = 0;
+  if (state->index == 0) {
+    return;
+  }
+
+  // stage 1: records as char + varint count
+  uint8_t *raw = (uint8_t *) malloc_or_die(state->index * 6, "varint buffer of %i records", state->index);
+  size_t raw_len = 0;
+  uint64_t uncompressed = 0;
+  for (int i = 0; i < state->index; i++) {
+    raw[raw_len++] = state->chars_arr[i];
+    uint32_t count = state->num_chars_arr[i];
+    uncompressed += count;
+    while (count >= 0x80) {
+      raw[raw_len++] = (count & 0x7f) | 0x80;
+      count >>= 7;
+    }
+    raw[raw_len++] = count;
+  }
+
+  // stage 2: a Huffman code for those bytes
+  uint64_t freqs[256] = { 0 };
+  for (size_t i = 0; i < raw_len; i++) {
+    freqs[raw[i]]++;
+  }
+  uint8_t lens[256];
+  uint16_t codes[256];
+  huffman_lengths(freqs, lens);
+  canonical_codes(lens, codes);
+
+  buffer_reserve(out, ENTROPY_HEADER_SIZE + raw_len * MAX_CODE_LEN / 8 + 8);
+  char *header = out->data;
+  uint32_t raw_len32 = raw_len;
+  memcpy(header + sizeof(uint32_t), &raw_len32, sizeof(uint32_t));
+  memcpy(header + 2 * sizeof(uint32_t), &uncompressed, sizeof(uint64_t));
+  for (int sym = 0; sym < 256; sym += 2) {
+    header[2 * sizeof(uint32_t) + sizeof(uint64_t) + sym / 2] = (lens[sym] << 4) | lens[sym + 1];
+  }
+
+  uint8_t *bits = (uint8_t *) out->data + ENTROPY_HEADER_SIZE;
+  size_t num_bytes = 0;
+  uint64_t acc = 0;
+  int num_bits = 0;
+  for (size_t i = 0; i < raw_len; i++) {
+    acc = (acc << lens[raw[i]]) | codes[raw[i]];
+    num_bits += lens[raw[i]];
+    while (num_bits >= 8) {
+      num_bits -= 8;
+      bits[num_bytes++] = acc >> num_bits;
+    }
+  }
+  if (num_bits > 0) {
+    bits[num_bytes++] = acc << (8 - num_bits);
+  }
+  uint32_t coded_len = num_bytes;
+  memcpy(header, &coded_len, sizeof(uint32_t));
+  out->len = ENTROPY_HEADER_SIZE + num_bytes;
+  free(raw);
+}
+
+// input files
+
+// every input file is mapped once up front and laid end to end, so the
+// workers see one logical byte stream instead of one file at a time.
+// offset is where this file's first byte lands in that stream.
+typedef struct input_t {
+  char *filepath;
   char *text;
+  size_t size;
+  size_t offset;
+  size_t map_size; // can be bigger than size when the text is in a huge page buffer
+} input_t;
+
+// for IO_READ. returns an anonymous mapping of at least size bytes,
+// backed by huge pages if the system will give us any.
+char *alloc_huge_buffer(size_t size, size_t *map_size) {
+  *map_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  char *buf = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  buf = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+  if (buf == MAP_FAILED) {
+    buf = mmap(NULL, *map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    die_if(buf == MAP_FAILED, "Failed to map a buffer of %zu", *map_size);
+#ifdef MADV_HUGEPAGE
+    madvise(buf, *map_size, MADV_HUGEPAGE); // only a hint, ok if it fails
+#endif
+  }
+  return buf;
+}
+
+void input_open(input_t *this, char *filepath, size_t offset) {
+  this->filepath = filepath;
+  this->offset = offset;
+  this->text = NULL;
+
+  int fd = open(filepath, O_RDONLY);
+  die_if(fd < 0, "could not open %s", filepath);
+
+  struct stat statbuf;
+  int err = fstat(fd, &statbuf);
+  die_if(err < 0, "could not get stats on %s", filepath);
+  this->size = statbuf.st_size;
+  this->map_size = this->size;
+
+  // mmap refuses zero-length mappings, and there is nothing to compress anyway
+  if (this->size == 0) {
+    close(fd);
+    return;
+  }
+
+  if (io_mode == IO_READ) {
+    this->text = alloc_huge_buffer(this->size, &(this->map_size));
+    for (size_t got = 0; got < this->size; ) {
+      ssize_t n = read(fd, this->text + got, this->size - got);
+      die_if(n <= 0, "could not read %s", filepath);
+      got += n;
+    }
+  } else {
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (io_mode == IO_POPULATE) {
+      flags |= MAP_POPULATE;
+    }
+#endif
+    this->text = mmap(NULL, this->size, PROT_READ, flags, fd, 0);
+    die_if(this->text == MAP_FAILED, "mmap failed on %s", filepath);
+    if (io_mode == IO_ADVISE) {
+      // only hints, ok if they fail
+      madvise(this->text, this->size, MADV_SEQUENTIAL);
+      madvise(this->text, this->size, MADV_WILLNEED);
+    }
+  }
+  close(fd);
+}
+
+void input_close(input_t *this) {
+  if (this->text != NULL) {
+    int err = munmap(this->text, this->map_size);
+    die_if(err != 0, "munmap failed on %s", this->filepath);
+  }
+}
+
+// stuff for the threads
+
+// a chunk is a range [start, end) of the logical stream. it can cross file
+// boundaries, and runs that continue into the next file are kept together.
+typedef struct chunk_t {
+  size_t start;
+  size_t end;
   state_t state;
-} thread_args_t;
-
-// compresses 1 / NUM_CORES of the file
-void *thread_func(void *threadArgsVoid) {
-  thread_args_t *thread_args = (thread_args_t *) threadArgsVoid;
-  char *text = thread_args->text;
-
-  int i = thread_args->start_index + 1;
-  int num_chars = 1;
-  char curr_char = text[thread_args->start_index];
-  while(i < thread_args->end_index) {
-    if (text[i] != curr_char) {
-      state_add(&(thread_args->state), num_chars, curr_char);
-      num_chars = 1;
-      curr_char = text[i];
+  buffer_t coded; // only for -e
+} chunk_t;
+
+// shared by all worker threads. workers keep taking the next unclaimed chunk
+// until there are none left, so a slow thread just ends up doing fewer chunks.
+typedef struct pool_t {
+  input_t *inputs;
+  int num_inputs;
+  chunk_t *chunks;
+  int num_chunks;
+  int next_chunk;
+  pthread_mutex_t lock;
+} pool_t;
+
+// index of the input file containing logical offset pos (binary search)
+int pool_find_input(pool_t *pool, size_t pos) {
+  int lo = 0;
+  int hi = pool->num_inputs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (pool->inputs[mid].offset <= pos) {
+      lo = mid;
     } else {
-      num_chars++;
+      hi = mid - 1;
     }
-    i++;
   }
-  state_add(&(thread_args->state), num_chars, curr_char);
-  return NULL;
+  return lo;
 }
 
+// compresses one chunk of the logical stream into chunk->state
+void compress_chunk(pool_t *pool, chunk_t *chunk) {
+  size_t pos = chunk->start;
+  for (int f = pool_find_input(pool, pos); pos < chunk->end; f++) {
+    input_t *input = &(pool->inputs[f]);
+    size_t i = pos - input->offset;
+    size_t end = input->size;
+    if (input->offset + end > chunk->end) {
+      end = chunk->end - input->offset;
+    }
+    pos += end - i;
+    compress_text(input->text + i, end - i, &(chunk->state));
+  }
+}
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    if (argv[0][0] == '.' && argv[0][1] == '/') {
-      printf("%s: file1 [file2 ...]\n", argv[0] + 2);
+void *thread_func(void *pool_void) {
+  pool_t *pool = (pool_t *) pool_void;
+  while (true) {
+    pthread_mutex_lock(&(pool->lock));
+    int c = pool->next_chunk++;
+    pthread_mutex_unlock(&(pool->lock));
+    if (c >= pool->num_chunks) {
+      return NULL;
+    }
+    compress_chunk(pool, &(pool->chunks[c]));
+    if (is_entropy_coded) {
+      entropy_encode(&(pool->chunks[c].state), &(pool->chunks[c].coded));
+    }
+  }
+}
+
+
+// output
+
+void write_or_die(void *ptr, size_t size) {
+  die_if(fwrite(ptr, size, 1, stdout) != 1 && size > 0, "could not write output");
+}
+
+// states are fed to the writer in stream order. it holds back the last run
+// it has seen, because the next state may start with the same char, and
+// that's how runs split across chunks, blocks and files get joined.
+typedef struct writer_t {
+  uint32_t interval; // 0 for the plain format, K for -i K
+  int pending_count;
+  char pending_char;
+  uint64_t num_records;
+  uint64_t uncompressed;
+  uint64_t compressed;
+  uint64_t *entries; // (uncompressed, compressed) pairs for the index
+  uint64_t num_entries;
+  uint64_t entries_size;
+  char *literals; // only for -c, the literal bytes not written yet
+  size_t num_literals;
+} writer_t;
+
+void writer_init(writer_t *this, uint32_t interval) {
+  this->interval = interval;
+  this->pending_count = 0;
+  this->pending_char = 0;
+  this->num_records = 0;
+  this->uncompressed = 0;
+  this->compressed = 0;
+  this->entries = NULL;
+  this->num_entries = 0;
+  this->entries_size = 0;
+  this->literals = NULL;
+  this->num_literals = 0;
+  if (is_compact) {
+    this->literals = (char *) malloc_or_die(MAX_LITERAL_LEN, "literal buffer");
+    write_or_die(COMPACT_MAGIC, MAGIC_SIZE);
+  }
+  if (is_entropy_coded) {
+    write_or_die(ENTROPY_MAGIC, MAGIC_SIZE);
+  }
+  if (interval > 0) {
+    write_or_die(INDEXED_MAGIC, MAGIC_SIZE);
+    write_or_die(&interval, sizeof(uint32_t));
+    this->compressed = MAGIC_SIZE + sizeof(uint32_t);
+  }
+}
+
+void write_record(int num_chars, char c) {
+  char record[RECORD_SIZE];
+  memcpy(record, &num_chars, sizeof(int));
+  record[sizeof(int)] = c;
+  write_or_die(record, RECORD_SIZE);
+}
+
+// writes a token header for -c
+void write_varint(uint64_t value) {
+  uint8_t bytes[MAX_VARINT_SIZE];
+  int len = 0;
+  while (value >= 0x80) {
+    bytes[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  bytes[len++] = value;
+  write_or_die(bytes, len);
+}
+
+void writer_flush_literals(writer_t *this) {
+  if (this->num_literals == 0) {
+    return;
+  }
+  write_varint(((uint64_t) this->num_literals << 1) | 1);
+  write_or_die(this->literals, this->num_literals);
+  this->num_literals = 0;
+}
+
+// short runs are added to the literals, longer ones get a token of their own
+void writer_add_compact(writer_t *this, int num_chars, char c) {
+  if (num_chars >= COMPACT_MIN_RUN) {
+    writer_flush_literals(this);
+    write_varint((uint64_t) num_chars << 1);
+    write_or_die(&c, 1);
+    return;
+  }
+  if (this->num_literals + num_chars > MAX_LITERAL_LEN) {
+    writer_flush_literals(this);
+  }
+  memset(this->literals + this->num_literals, c, num_chars);
+  this->num_literals += num_chars;
+}
+
+void writer_flush_pending(writer_t *this) {
+  if (this->pending_count == 0) {
+    return;
+  }
+  if (is_compact) {
+    writer_add_compact(this, this->pending_count, this->pending_char);
+    this->pending_count = 0;
+    return;
+  }
+  if (this->interval > 0 && this->num_records % this->interval == 0) {
+    if (this->num_entries == this->entries_size) {
+      this->entries_size = this->entries_size == 0 ? 128 : this->entries_size * 2;
+      this->entries = (uint64_t *) realloc(this->entries, sizeof(uint64_t) * 2 * this->entries_size);
+      die_if(this->entries == NULL, "Failed to realloc index of %llu entries", (unsigned long long) this->entries_size);
+    }
+    this->entries[2 * this->num_entries] = this->uncompressed;
+    this->entries[2 * this->num_entries + 1] = this->compressed;
+    this->num_entries++;
+  }
+  write_record(this->pending_count, this->pending_char);
+  this->num_records++;
+  this->uncompressed += this->pending_count;
+  this->compressed += RECORD_SIZE;
+  this->pending_count = 0;
+}
+
+void writer_add(writer_t *this, state_t *state) {
+  for (int i = 0; i < state->index; i++) {
+    int num_chars = state->num_chars_arr[i];
+    char c = state->chars_arr[i];
+    // a run too long for the 4-byte count just becomes two records
+    if (this->pending_count > 0 && c == this->pending_char && num_chars <= INT_MAX - this->pending_count) {
+      this->pending_count += num_chars;
     } else {
-      printf("%s: file1 [file2 ...]\n", argv[0]);
+      writer_flush_pending(this);
+      this->pending_count = num_chars;
+      this->pending_char = c;
     }
-    exit(1);
   }
-  
-  state_t combined_state;
-  state_init(&combined_state);
-  // iterate over each filepath in argv
-  for (int i = 1; i < argc; i++) {
-    char *filepath = argv[i];
+}
+
+// writes the last run and, for the indexed format, the footer
+void writer_finish(writer_t *this) {
+  writer_flush_pending(this);
+  writer_flush_literals(this);
+  if (this->interval > 0) {
+    write_record(INDEXED_END_COUNT, 0);
+    write_or_die(this->entries, sizeof(uint64_t) * 2 * this->num_entries);
+    write_or_die(&(this->num_entries), sizeof(uint64_t));
+    write_or_die(&(this->uncompressed), sizeof(uint64_t));
+    write_or_die(INDEXED_MAGIC, MAGIC_SIZE);
+  }
+  free(this->entries);
+  free(this->literals);
+  die_if(fflush(stdout) != 0, "could not write output");
+}
 
-    int fd = open(filepath, O_RDONLY);
-    die_if(fd < 0, "could not open %s", filepath);
+// streaming
 
-    struct stat statbuf;
-    int err = fstat(fd, &statbuf);
-    die_if(err < 0, "could not get stats on %s", filepath);
+// inputs that can't be mapped (stdin as "-", pipes, terminals) are read in
+// blocks instead. a reader thread fills a ring of blocks, the worker threads
+// compress whichever filled block is next, and the main thread writes the
+// compressed blocks out in order and hands them back to the reader. so reads,
+// compression and output all overlap, and at most
+// num_blocks * STREAM_BLOCK_SIZE bytes of input are held at once.
+typedef enum block_status_t {
+  BLOCK_EMPTY,
+  BLOCK_FILLED,
+  BLOCK_COMPRESSED,
+} block_status_t;
 
-    char *text = mmap(NULL,statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
-    die_if(text == MAP_FAILED, "mmap failed on %s", filepath);
-    close(fd);
+typedef struct block_t {
+  char *text;
+  size_t len;
+  state_t state;
+  buffer_t coded; // only for -e
+  block_status_t status;
+} block_t;
 
-    int bytes_per_thread = statbuf.st_size / NUM_CORES;
+// block number seq lives in blocks[seq % num_blocks]
+typedef struct stream_t {
+  char **filepaths;
+  int num_files;
+  block_t *blocks;
+  int num_blocks;
+  long next_fill;
+  long next_compress;
+  bool eof;
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} stream_t;
 
-    // initialize state for threads
-    thread_args_t *thread_args = (thread_args_t *) malloc_or_die(sizeof(thread_args_t) * NUM_CORES, "thread_args");
-    for (int i = 0; i < NUM_CORES; i++) {
-      thread_args[i].start_index = i * bytes_per_thread;
-      thread_args[i].end_index = (i+1) * bytes_per_thread;
-      thread_args[i].text = text;
-      state_init(&(thread_args[i].state));
+void *stream_reader(void *stream_void) {
+  stream_t *stream = (stream_t *) stream_void;
+  int f = 0;
+  int fd = -1;
+  for (long seq = 0; ; seq++) {
+    block_t *block = &(stream->blocks[seq % stream->num_blocks]);
+    pthread_mutex_lock(&(stream->lock));
+    while (block->status != BLOCK_EMPTY) {
+      pthread_cond_wait(&(stream->changed), &(stream->lock));
     }
-    thread_args[NUM_CORES - 1].end_index = statbuf.st_size;
+    pthread_mutex_unlock(&(stream->lock));
 
-    print_verbose("File size: %lli\n\n", statbuf.st_size);
-    if (is_verbose) {
-      for (int i = 0; i < NUM_CORES; i++) {
-        print_verbose("thread %i: (%i, %i)\n", i, thread_args[i].start_index , thread_args[i].end_index);
+    block->len = 0;
+    while (block->len < STREAM_BLOCK_SIZE && f < stream->num_files) {
+      char *filepath = stream->filepaths[f];
+      if (fd < 0) {
+        fd = strcmp(filepath, "-") == 0 ? STDIN_FILENO : open(filepath, O_RDONLY);
+        die_if(fd < 0, "could not open %s", filepath);
+      }
+      ssize_t n = read(fd, block->text + block->len, STREAM_BLOCK_SIZE - block->len);
+      die_if(n < 0, "could not read %s", filepath);
+      if (n == 0) {
+        if (fd != STDIN_FILENO) {
+          close(fd);
+        }
+        fd = -1;
+        f++;
       }
+      block->len += n;
     }
 
+    pthread_mutex_lock(&(stream->lock));
+    if (block->len == 0) {
+      stream->eof = true;
+    } else {
+      block->status = BLOCK_FILLED;
+      stream->next_fill++;
+    }
+    pthread_cond_broadcast(&(stream->changed));
+    pthread_mutex_unlock(&(stream->lock));
+    if (block->len == 0) {
+      return NULL;
+    }
+  }
+}
 
-    // run threads on sub-portions of the file
-    pthread_t *threads = (pthread_t *) malloc_or_die(sizeof(pthread_t) * NUM_CORES, "threads");
-    for (int i = 0; i < NUM_CORES; i++) {
-      int rc = pthread_create(&threads[i], NULL, &thread_func, (void *) &thread_args[i]);
-      die_if(rc != 0, "Error creating thread %i", i);
+void *stream_worker(void *stream_void) {
+  stream_t *stream = (stream_t *) stream_void;
+  while (true) {
+    pthread_mutex_lock(&(stream->lock));
+    while (stream->next_compress == stream->next_fill && !stream->eof) {
+      pthread_cond_wait(&(stream->changed), &(stream->lock));
     }
-      
-    // join the threads
-    print_verbose("\n");
-    for (int i = 0; i < NUM_CORES; i++) {
-      int thread_rc = pthread_join(threads[i], NULL);
-      die_if(thread_rc != 0, "Error joining thread %i", i);
-      if (is_verbose) {
-        state_print(&(thread_args[i].state));
-      }
+    if (stream->next_compress == stream->next_fill) {
+      pthread_mutex_unlock(&(stream->lock));
+      return NULL;
+    }
+    block_t *block = &(stream->blocks[stream->next_compress++ % stream->num_blocks]);
+    pthread_mutex_unlock(&(stream->lock));
+
+    compress_text(block->text, block->len, &(block->state));
+    if (is_entropy_coded) {
+      entropy_encode(&(block->state), &(block->coded));
     }
-      
-    // merge the outputs
-    for (int i = 0; i < NUM_CORES; i++) {
-      state_merge(&(combined_state), &(thread_args[i].state));
+
+    pthread_mutex_lock(&(stream->lock));
+    block->status = BLOCK_COMPRESSED;
+    pthread_cond_broadcast(&(stream->changed));
+    pthread_mutex_unlock(&(stream->lock));
+  }
+}
+
+void compress_stream(char **filepaths, int num_files, int num_threads, writer_t *writer) {
+  stream_t stream;
+  stream.filepaths = filepaths;
+  stream.num_files = num_files;
+  stream.num_blocks = num_threads * BLOCKS_PER_THREAD;
+  stream.blocks = (block_t *) malloc_or_die(sizeof(block_t) * stream.num_blocks, "blocks");
+  for (int i = 0; i < stream.num_blocks; i++) {
+    stream.blocks[i].text = (char *) malloc_or_die(STREAM_BLOCK_SIZE, "block %i", i);
+    stream.blocks[i].status = BLOCK_EMPTY;
+    state_init(&(stream.blocks[i].state));
+    buffer_init(&(stream.blocks[i].coded));
+  }
+  stream.next_fill = 0;
+  stream.next_compress = 0;
+  stream.eof = false;
+  pthread_mutex_init(&(stream.lock), NULL);
+  pthread_cond_init(&(stream.changed), NULL);
+
+  print_verbose("Streaming %i blocks of %i, %i threads\n\n", stream.num_blocks, STREAM_BLOCK_SIZE, num_threads);
+
+  pthread_t reader;
+  int rc = pthread_create(&reader, NULL, &stream_reader, (void *) &stream);
+  die_if(rc != 0, "Error creating reader thread");
+  pthread_t *threads = (pthread_t *) malloc_or_die(sizeof(pthread_t) * num_threads, "threads");
+  for (int i = 0; i < num_threads; i++) {
+    rc = pthread_create(&threads[i], NULL, &stream_worker, (void *) &stream);
+    die_if(rc != 0, "Error creating thread %i", i);
+  }
+
+  // write the blocks out in order as they get compressed
+  for (long seq = 0; ; seq++) {
+    block_t *block = &(stream.blocks[seq % stream.num_blocks]);
+    pthread_mutex_lock(&(stream.lock));
+    while (block->status != BLOCK_COMPRESSED && !(stream.eof && seq == stream.next_fill)) {
+      pthread_cond_wait(&(stream.changed), &(stream.lock));
     }
+    bool done = block->status != BLOCK_COMPRESSED;
+    pthread_mutex_unlock(&(stream.lock));
+    if (done) {
+      break;
+    }
+
     if (is_verbose) {
-      printf("\n");
-      state_print(&combined_state);
+      state_print(&(block->state));
+    }
+    if (is_entropy_coded) {
+      write_or_die(block->coded.data, block->coded.len);
+    } else {
+      writer_add(writer, &(block->state));
     }
+    block->state.index = 0;
+
+    pthread_mutex_lock(&(stream.lock));
+    block->status = BLOCK_EMPTY;
+    pthread_cond_broadcast(&(stream.changed));
+    pthread_mutex_unlock(&(stream.lock));
+  }
+
+  rc = pthread_join(reader, NULL);
+  die_if(rc != 0, "Error joining reader thread");
+  for (int i = 0; i < num_threads; i++) {
+    rc = pthread_join(threads[i], NULL);
+    die_if(rc != 0, "Error joining thread %i", i);
+  }
+
+  for (int i = 0; i < stream.num_blocks; i++) {
+    free(stream.blocks[i].text);
+    state_free(&(stream.blocks[i].state));
+    buffer_free(&(stream.blocks[i].coded));
+  }
+  pthread_mutex_destroy(&(stream.lock));
+  pthread_cond_destroy(&(stream.changed));
+  free(threads);
+  free(stream.blocks);
+}
+
+// mapped files
+
+void compress_mapped(char **filepaths, int num_files, int num_threads, writer_t *writer) {
+  // map every file up front and stitch them into one logical stream
+  pool_t pool;
+  pool.num_inputs = num_files;
+  pool.inputs = (input_t *) malloc_or_die(sizeof(input_t) * pool.num_inputs, "inputs");
+  size_t total_size = 0;
+  for (int i = 0; i < pool.num_inputs; i++) {
+    input_open(&(pool.inputs[i]), filepaths[i], total_size);
+    total_size += pool.inputs[i].size;
+  }
 
-    // cleanup
-    err = munmap(text, statbuf.st_size);
-    die_if(err != 0, "munmap failed on %s", filepath);
-    free(threads);
-    for (int i = 0; i < NUM_CORES; i++) {
-      state_free(&(thread_args[i].state));
+  // split the stream into more chunks than threads so the work balances out,
+  // but don't make them so small that the per-chunk overhead dominates
+  size_t chunk_size = total_size / ((size_t) num_threads * CHUNKS_PER_THREAD);
+  if (chunk_size < MIN_CHUNK_SIZE) {
+    chunk_size = MIN_CHUNK_SIZE;
+  }
+  // a run is counted in an int, so a chunk must never hold more than INT_MAX
+  // bytes whatever the format
+  if (chunk_size > INT_MAX) {
+    chunk_size = INT_MAX;
+  }
+  // with -e every chunk becomes a block that wunzip decodes on its own, so
+  // keep them small enough that a window of output still spans many blocks
+  if (is_entropy_coded && chunk_size > MAX_CHUNK_SIZE) {
+    chunk_size = MAX_CHUNK_SIZE;
+  }
+  pool.num_chunks = (total_size + chunk_size - 1) / chunk_size;
+  pool.chunks = (chunk_t *) malloc_or_die(sizeof(chunk_t) * pool.num_chunks, "chunks");
+  for (int i = 0; i < pool.num_chunks; i++) {
+    pool.chunks[i].start = i * chunk_size;
+    pool.chunks[i].end = (i + 1) * chunk_size;
+    state_init(&(pool.chunks[i].state));
+    buffer_init(&(pool.chunks[i].coded));
+  }
+  if (pool.num_chunks > 0) {
+    pool.chunks[pool.num_chunks - 1].end = total_size;
+  }
+  pool.next_chunk = 0;
+  pthread_mutex_init(&(pool.lock), NULL);
+  if (num_threads > pool.num_chunks) {
+    num_threads = pool.num_chunks;
+  }
+
+  print_verbose("Total size: %zu, %i chunks of %zu, %i threads\n\n", total_size, pool.num_chunks, chunk_size, num_threads);
+
+  // one pool of threads works through the chunks of all the files
+  pthread_t *threads = (pthread_t *) malloc_or_die(sizeof(pthread_t) * num_threads, "threads");
+  for (int i = 0; i < num_threads; i++) {
+    int rc = pthread_create(&threads[i], NULL, &thread_func, (void *) &pool);
+    die_if(rc != 0, "Error creating thread %i", i);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    int thread_rc = pthread_join(threads[i], NULL);
+    die_if(thread_rc != 0, "Error joining thread %i", i);
+  }
+
+  // write the chunks out in stream order
+  for (int i = 0; i < pool.num_chunks; i++) {
+    if (is_verbose) {
+      state_print(&(pool.chunks[i].state));
+    }
+    if (is_entropy_coded) {
+      write_or_die(pool.chunks[i].coded.data, pool.chunks[i].coded.len);
+    } else {
+      writer_add(writer, &(pool.chunks[i].state));
     }
-    free(thread_args);
   }
 
-  // print the outputs to standard out
-  for (int i = 0; i < combined_state.index; i++) {
-    fwrite(&(combined_state.num_chars_arr[i]), 4, 1, stdout);
-    printf("%c", combined_state.chars_arr[i]);
+  // cleanup
+  for (int i = 0; i < pool.num_chunks; i++) {
+    state_free(&(pool.chunks[i].state));
+    buffer_free(&(pool.chunks[i].coded));
   }
+  for (int i = 0; i < pool.num_inputs; i++) {
+    input_close(&(pool.inputs[i]));
+  }
+  pthread_mutex_destroy(&(pool.lock));
+  free(threads);
+  free(pool.chunks);
+  free(pool.inputs);
+}
 
-  // final_cleanup
-  state_free(&combined_state);
+void print_usage(char *prog) {
+  if (prog[0] == '.' && prog[1] == '/') {
+    printf("%s: file1 [file2 ...]\n", prog + 2);
+  } else {
+    printf("%s: file1 [file2 ...]\n", prog);
+  }
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  int index_interval = 0;
+  int num_threads = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "cei:m:t:")) != -1) {
+    switch (opt) {
+    case 'c':
+      is_compact = true;
+      break;
+    case 'e':
+      is_entropy_coded = true;
+      break;
+    case 'i':
+      index_interval = atoi(optarg);
+      die_if(index_interval <= 0, "index interval must be positive");
+      break;
+    case 'm': {
+      int num_modes = sizeof(io_mode_names) / sizeof(io_mode_names[0]);
+      int mode = 0;
+      while (mode < num_modes && strcmp(optarg, io_mode_names[mode]) != 0) {
+        mode++;
+      }
+      die_if(mode == num_modes, "unknown io mode %s (mmap, advise, populate or read)", optarg);
+      io_mode = (io_mode_t) mode;
+      break;
+    }
+    case 't':
+      num_threads = atoi(optarg);
+      die_if(num_threads <= 0, "thread count must be positive");
+      break;
+    default:
+      print_usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {
+    print_usage(argv[0]);
+  }
+  die_if(is_entropy_coded && index_interval > 0, "-e and -i can't be used together");
+  die_if(is_compact && (is_entropy_coded || index_interval > 0), "-c can't be used with -e or -i");
+
+  if (num_threads == 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads < 1) {
+    num_threads = DEFAULT_NUM_THREADS;
+  }
+
+  // regular files get mapped. if anything else is in the list ("-" for
+  // stdin, a pipe, a device) the whole list is streamed instead.
+  bool can_map = true;
+  for (int i = optind; i < argc; i++) {
+    struct stat statbuf;
+    if (strcmp(argv[i], "-") == 0) {
+      can_map = false;
+    } else {
+      die_if(stat(argv[i], &statbuf) < 0, "could not open %s", argv[i]);
+      can_map = can_map && S_ISREG(statbuf.st_mode);
+    }
+  }
+
+  // a large stdout buffer keeps the 5-byte record writes cheap
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+  writer_t writer;
+  writer_init(&writer, index_interval);
+  if (can_map) {
+    compress_mapped(argv + optind, argc - optind, num_threads, &writer);
+  } else {
+    compress_stream(argv + optind, argc - optind, num_threads, &writer);
+  }
+  writer_finish(&writer);
 
   return 0;
 }
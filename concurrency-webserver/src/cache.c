@@ -0,0 +1,142 @@
+#include "io_helper.h"
+#include "cache.h"
+
+//
+// The file cache shared by all the threads. Entries are found through a
+// hash table on the path and kept in a list ordered by last use; when the
+// total size goes over the cap, entries are dropped from the front.
+//
+// An entry is checked against a fresh stat() of its file on every lookup
+// and dropped if the file has changed. A dropped entry is freed once the
+// last response using it has been sent.
+//
+
+#define BUCKETS (4096)
+
+static cache_entry_t *buckets[BUCKETS];
+static cache_entry_t *oldest, *newest;
+static size_t used, max_used;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int cache_hash(char *path) {
+    unsigned int h = 2166136261u; // FNV-1a
+    for (; *path != '\0'; path++)
+	h = (h ^ (unsigned char) *path) * 16777619u;
+    return h % BUCKETS;
+}
+
+//
+// 0 turns the cache off
+//
+void cache_init(size_t max_bytes) {
+    max_used = max_bytes;
+}
+
+//
+// Files bigger than an eighth of the cap aren't cached, so one of them
+// can't push out the many small files that make up most hits
+//
+int cache_fits(off_t size) {
+    return max_used > 0 && (size_t) size <= max_used / 8;
+}
+
+static int same_file(struct stat *a, struct stat *b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static void entry_free(cache_entry_t *entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry);
+}
+
+static void lru_unlink(cache_entry_t *entry) {
+    if (entry->prev != NULL)
+	entry->prev->next = entry->next;
+    else
+	oldest = entry->next;
+    if (entry->next != NULL)
+	entry->next->prev = entry->prev;
+    else
+	newest = entry->prev;
+}
+
+static void lru_link(cache_entry_t *entry) {
+    entry->next = NULL;
+    entry->prev = newest;
+    if (newest != NULL)
+	newest->next = entry;
+    else
+	oldest = entry;
+    newest = entry;
+}
+
+//
+// Takes entry out of the cache and drops the cache's reference; the caller holds the lock
+//
+static void cache_remove(cache_entry_t *entry) {
+    cache_entry_t **p = &buckets[cache_hash(entry->path)];
+    while (*p != entry)
+	p = &(*p)->chain;
+    *p = entry->chain;
+    lru_unlink(entry);
+    used -= entry->size;
+    if (--entry->refs == 0)
+	entry_free(entry);
+}
+
+//
+// The entry for path if it is cached and the file, as sbuf describes it
+// now, hasn't changed since it was read; NULL otherwise. An entry that is
+// returned has to be given back with cache_release().
+//
+cache_entry_t *cache_find(char *path, struct stat *sbuf) {
+    if (max_used == 0)
+	return NULL;
+    pthread_mutex_lock_or_die(&cache_lock);
+    cache_entry_t *entry = buckets[cache_hash(path)];
+    while (entry != NULL && strcmp(entry->path, path) != 0)
+	entry = entry->chain;
+    if (entry != NULL && !same_file(&entry->sbuf, sbuf)) {
+	cache_remove(entry);
+	entry = NULL;
+    }
+    if (entry != NULL) {
+	entry->refs++;
+	lru_unlink(entry);
+	lru_link(entry);
+    }
+    pthread_mutex_unlock_or_die(&cache_lock);
+    return entry;
+}
+
+//
+// Adds a new entry, whose one reference stays with the caller, replacing
+// any older one for the same path and making room if need be
+//
+void cache_add(cache_entry_t *entry) {
+    pthread_mutex_lock_or_die(&cache_lock);
+    unsigned int h = cache_hash(entry->path);
+    cache_entry_t *old = buckets[h];
+    while (old != NULL && strcmp(old->path, entry->path) != 0)
+	old = old->chain;
+    if (old != NULL)
+	cache_remove(old);
+    entry->refs++;
+    entry->chain = buckets[h];
+    buckets[h] = entry;
+    lru_link(entry);
+    used += entry->size;
+    while (used > max_used && oldest != entry)
+	cache_remove(oldest);
+    pthread_mutex_unlock_or_die(&cache_lock);
+}
+
+void cache_release(cache_entry_t *entry) {
+    pthread_mutex_lock_or_die(&cache_lock);
+    int refs = --entry->refs;
+    pthread_mutex_unlock_or_die(&cache_lock);
+    if (refs == 0)
+	entry_free(entry);
+}
@@ -0,0 +1,32 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <sys/stat.h>
+#include <pthread.h>
+
+//
+// A static file held in memory together with its response headers, so a
+// hit is answered straight from data. The headers for the two values of
+// Connection differ, so both are kept: the keep-alive one in front of the
+// file, making that response one contiguous block, the close one after it.
+//
+typedef struct cache_entry {
+    char *path;
+    struct stat sbuf;            // of the file when it was read
+    char *data;                  // keep-alive header, file, close header
+    size_t size;                 // bytes in data
+    int head_len;                // of the keep-alive header
+    int close_len;               // of the close header
+    int refs;                    // the cache's own, plus one per response being sent
+    struct cache_entry *chain;   // next in the hash bucket
+    struct cache_entry *prev;    // in the LRU list, least recently used first
+    struct cache_entry *next;
+} cache_entry_t;
+
+void cache_init(size_t max_bytes);
+int cache_fits(off_t size);
+cache_entry_t *cache_find(char *path, struct stat *sbuf);
+void cache_add(cache_entry_t *entry);
+void cache_release(cache_entry_t *entry);
+
+#endif // __CACHE_H__
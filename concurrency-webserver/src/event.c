@@ -0,0 +1,623 @@
+#define _GNU_SOURCE // for accept4
+#include <sys/epoll.h>
+#include "io_helper.h"
+#include "request.h"
+#include "event.h"
+
+//
+// The event-driven server (-e). Each event loop thread has its own
+// listening socket (all bound to the same port with SO_REUSEPORT, so the
+// kernel spreads connections over them) and its own edge-triggered epoll
+// set. A loop reads request headers and sends static files, from the cache
+// or with sendfile(), without ever blocking. A request for a persistent CGI
+// program is passed to an idle process of its pool, and the loop watches
+// for the reply along with everything else; if the pool is busy, the
+// request waits in the loop until a process is put back. Work that would
+// block -- running a CGI program or reading a file that isn't in the page
+// cache -- is handed to the helper threads through the same buffer the
+// thread pool uses. (A helper never waits for a process that a loop is
+// using, since the loop may itself be waiting for room in the buffer.)
+//
+// Connections are kept alive between requests, and pipelined requests are
+// answered in order from what is left in the input buffer. Every loop keeps
+// its connections in a list ordered by when they were last active, so the
+// idle ones are found at the front and closed in O(1) each.
+//
+
+#define MAXEVENTS (256)
+
+typedef struct conn {
+    int fd;
+    struct conn *prev;       // in the loop's list, least recently active first
+    struct conn *next;
+    time_t last_active;
+    long accepted;           // stats_now() when it was accepted
+    long started;            // and when the current response was started
+    int served;              // requests answered on this connection
+    int keep_alive;          // of the request being answered
+    char in[MAXBUF];         // request line and headers read so far
+    int in_len;
+    int responding;          // 1 once the whole request has been read
+    int waiting;             // 1 while waiting for a persistent CGI process
+    request_t *req;          // being answered, kept for the access log
+    char out[MAXERROR];      // response header, or a whole error response
+    int out_len;
+    int out_sent;
+    cache_entry_t *entry;    // cached file being sent, or NULL
+    char *mem;               // the part of it that is sent
+    size_t mem_len;
+    size_t mem_sent;
+    fcgi_proc_t *proc;       // persistent CGI process being waited for, or NULL
+    fcgi_reply_t reply;      // what it has sent back
+    char *page;              // the stats page being sent, or NULL
+    int body_fd;             // file being sent, or -1
+    off_t body_len;          // where the part of it being sent ends
+    off_t body_sent;         // and how far it has got
+} conn_t;
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int spare_fd;            // held open for when the server runs out of fds
+    queue_t *helpers;
+    conn_t *oldest;          // list of open connections
+    conn_t *newest;
+    conn_t *waiting;         // and of those waiting for a CGI process, in
+    conn_t *waiting_last;    // the order they came, apart from the first list
+} loop_t;
+
+static void conn_unlink(loop_t *loop, conn_t *conn) {
+    if (conn->prev != NULL)
+	conn->prev->next = conn->next;
+    else
+	loop->oldest = conn->next;
+    if (conn->next != NULL)
+	conn->next->prev = conn->prev;
+    else
+	loop->newest = conn->prev;
+}
+
+static void conn_link(loop_t *loop, conn_t *conn) {
+    conn->last_active = time(NULL);
+    conn->next = NULL;
+    conn->prev = loop->newest;
+    if (loop->newest != NULL)
+	loop->newest->next = conn;
+    else
+	loop->oldest = conn;
+    loop->newest = conn;
+}
+
+static void conn_free_body(conn_t *conn) {
+    free(conn->req);
+    conn->req = NULL;
+    if (conn->entry != NULL)
+	cache_release(conn->entry);
+    conn->entry = NULL;
+    conn->mem_len = conn->mem_sent = 0;
+    free(conn->reply.data);
+    memset(&conn->reply, 0, sizeof(conn->reply));
+    free(conn->page);
+    conn->page = NULL;
+    if (conn->body_fd >= 0)
+	close_or_die(conn->body_fd);
+    conn->body_fd = -1;
+}
+
+static void conn_close(loop_t *loop, conn_t *conn) {
+    // a CGI process being started may briefly share the fd, and then
+    // closing it alone wouldn't take it out of the epoll set
+    assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == 0);
+    close_or_die(conn->fd);
+    conn_unlink(loop, conn);
+    conn_free_body(conn);
+    free(conn);
+}
+
+//
+// Gives the request to a helper thread, which serves it with blocking calls
+// and then closes the connection, so the helper isn't tied up by an idle client
+//
+static void conn_hand_off(loop_t *loop, conn_t *conn, request_t *req) {
+    assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == 0);
+    int flags = fcntl(conn->fd, F_GETFL);
+    assert(flags >= 0 && fcntl(conn->fd, F_SETFL, flags & ~O_NONBLOCK) == 0);
+    conn_unlink(loop, conn);
+    conn_free_body(conn);
+    free(conn);
+    req->keep_alive = 0;
+    stats_count(STAT_HANDOFFS);
+    queue_put(loop->helpers, req);
+}
+
+//
+// 1 if every page of the file is in the page cache, so sending it won't
+// block on the disk. The mapping is only there for mincore(); the data
+// itself goes out with sendfile().
+//
+static int is_resident(int fd, off_t len) {
+    char *map = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+	return 0;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t pages = (len + page_size - 1) / page_size;
+    unsigned char vec[MAXBUF];
+    int resident = 1;
+    for (size_t first = 0; first < pages && resident; first += MAXBUF) {
+	size_t n = pages - first < MAXBUF ? pages - first : MAXBUF;
+	if (mincore(map + first * page_size, n * page_size, vec) < 0)
+	    resident = 0;
+	for (size_t i = 0; i < n && resident; i++) {
+	    if (!(vec[i] & 1))
+		resident = 0;
+	}
+    }
+    munmap_or_die(map, len);
+    return resident;
+}
+
+//
+// Sends as much of the response as the socket takes. Returns 1 when it is
+// all sent, 0 if the socket is full and -1 if the client has gone.
+//
+static int conn_write(conn_t *conn) {
+    // the header and a cached file go out together in one sendmsg(); with a
+    // file still to follow, MSG_MORE lets the header share its first packet
+    int flags = MSG_NOSIGNAL | (conn->body_sent < conn->body_len ? MSG_MORE : 0);
+    while (conn->out_sent < conn->out_len || conn->mem_sent < conn->mem_len) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	if (conn->out_sent < conn->out_len) {
+	    iov[msg.msg_iovlen].iov_base = conn->out + conn->out_sent;
+	    iov[msg.msg_iovlen++].iov_len = conn->out_len - conn->out_sent;
+	}
+	if (conn->mem_sent < conn->mem_len) {
+	    iov[msg.msg_iovlen].iov_base = conn->mem + conn->mem_sent;
+	    iov[msg.msg_iovlen++].iov_len = conn->mem_len - conn->mem_sent;
+	}
+	ssize_t rc = sendmsg(conn->fd, &msg, flags);
+	if (rc < 0)
+	    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	size_t out_part = conn->out_len - conn->out_sent;
+	if ((size_t) rc < out_part)
+	    out_part = rc;
+	conn->out_sent += out_part;
+	conn->mem_sent += rc - out_part;
+    }
+    while (conn->body_sent < conn->body_len) {
+	// sendfile() moves the offset on by however much the socket took
+	ssize_t rc = sendfile(conn->fd, conn->body_fd, &conn->body_sent, conn->body_len - conn->body_sent);
+	if (rc < 0)
+	    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	if (rc == 0)
+	    return -1; // the file got shorter
+    }
+    return 1;
+}
+
+//
+// Where the request at the front of the input ends (just past the empty
+// line after its headers), or 0 if it hasn't all arrived
+//
+static int conn_request_end(conn_t *conn) {
+    char *crlf = strstr(conn->in, "\n\r\n");
+    char *lf = strstr(conn->in, "\n\n");
+    if (crlf != NULL && (lf == NULL || crlf < lf))
+	return crlf + 3 - conn->in;
+    if (lf != NULL)
+	return lf + 2 - conn->in;
+    return 0;
+}
+
+//
+// Gets ready for the next request on a kept-alive connection. Whatever
+// followed the last request in the input (pipelined requests) is kept.
+//
+static void conn_reset(conn_t *conn) {
+    int end = conn_request_end(conn);
+    conn->in_len -= end;
+    memmove(conn->in, conn->in + end, conn->in_len + 1);
+    conn->responding = 0;
+    conn->out_len = conn->out_sent = 0;
+    conn_free_body(conn);
+    conn->body_len = conn->body_sent = 0;
+}
+
+//
+// Passes the request to conn->proc and waits for the reply with epoll. The
+// pointer in the event has its low bit set to tell it from conn's own.
+// conn is out of the list meanwhile, so it doesn't count as idle.
+//
+static int conn_start_fcgi(loop_t *loop, conn_t *conn, request_t *req) {
+    if (fcgi_send_request(conn->proc, req->cgiargs) < 0) {
+	fcgi_release(conn->proc, 0);
+	conn->proc = NULL;
+	conn->out_len = request_format_error(conn->out, conn->keep_alive, req->filename, "502", "Bad Gateway", "CGI program failed");
+	req->status = 502;
+	req->bytes = conn->out_len;
+	return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = (char *) conn + 1;
+    assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, conn->proc->fd, &ev) == 0);
+    conn_unlink(loop, conn);
+    return 1;
+}
+
+//
+// Has epoll report conn's fd again, so the response is sent from conn's
+// own event, and only there can conn be freed
+//
+static void conn_rearm(loop_t *loop, conn_t *conn) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == 0);
+}
+
+//
+// Reads the reply from conn->proc and, once it is all in, sets it up for
+// conn_write
+//
+static void conn_fcgi_event(loop_t *loop, conn_t *conn) {
+    char *path = conn->proc->path;
+    int rc = fcgi_read_reply(conn->proc, &conn->reply, MSG_DONTWAIT);
+    if (rc == 0)
+	return;
+    assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->proc->fd, NULL) == 0);
+    fcgi_release(conn->proc, rc == 1);
+    conn->proc = NULL;
+    conn_link(loop, conn);
+    
+    conn->out_len = -1;
+    if (rc == 1)
+	conn->out_len = request_format_fcgi_header(conn->out, conn->reply.data, conn->reply.len, conn->keep_alive);
+    if (conn->out_len < 0) {
+	conn->out_len = request_format_error(conn->out, conn->keep_alive, path, "502", "Bad Gateway", "CGI program failed");
+	conn->req->status = 502;
+    } else {
+	conn->mem = conn->reply.data;
+	conn->mem_len = conn->reply.len;
+	conn->req->status = 200;
+    }
+    conn->req->bytes = conn->out_len + conn->mem_len;
+    conn_rearm(loop, conn);
+}
+
+//
+// Puts conn at the end of the loop's list of requests waiting for a
+// process of their program's pool. Like one waiting for a reply, it is
+// out of the list of connections meanwhile.
+//
+static void conn_wait_fcgi(loop_t *loop, conn_t *conn) {
+    conn_unlink(loop, conn);
+    conn->waiting = 1;
+    conn->next = NULL;
+    if (loop->waiting_last != NULL)
+	loop->waiting_last->next = conn;
+    else
+	loop->waiting = conn;
+    loop->waiting_last = conn;
+}
+
+//
+// A process has been put back in some pool: starts the waiting requests
+// that can have one now, in turn
+//
+static void loop_fcgi_idle(loop_t *loop) {
+    conn_t *conn = loop->waiting, *prev = NULL;
+    while (conn != NULL) {
+	conn_t *next = conn->next;
+	if ((conn->proc = fcgi_acquire(conn->req->filename, 0)) == NULL) {
+	    prev = conn;
+	    conn = next;
+	    continue;
+	}
+	if (prev != NULL)
+	    prev->next = next;
+	else
+	    loop->waiting = next;
+	if (loop->waiting_last == conn)
+	    loop->waiting_last = prev;
+	conn->waiting = 0;
+	conn_link(loop, conn);
+	conn_start_fcgi(loop, conn, conn->req);
+	if (conn->proc == NULL)
+	    conn_rearm(loop, conn); // it failed, and the 502 is ready to send
+	conn = next;
+    }
+}
+
+//
+// Called once the whole request is in: either sets up the response for
+// conn_write, or hands the request off. Returns 1 if conn is still ours.
+//
+static int conn_start_response(loop_t *loop, conn_t *conn) {
+    request_t *req = request_parse(conn->fd, conn->in, conn_request_end(conn));
+    conn->started = stats_now();
+    if (conn->served == 0)
+	stats_time(STAT_ACCEPT_WAIT, req->t_read - conn->accepted);
+    conn->responding = 1;
+    if (++conn->served >= request_max_per_conn)
+	req->keep_alive = 0;
+    conn->keep_alive = req->keep_alive;
+    // requests handed off are counted (and logged) by the helper that serves them
+    conn->out_len = request_check(req, conn->out);
+    if (conn->out_len > 0) {
+	stats_count(STAT_REQUESTS);
+	stats_count(STAT_ERRORS);
+	req->status = request_status(conn->out);
+	req->bytes = conn->out_len;
+	conn->req = req;
+	return 1;
+    }
+    if (req->is_stats) {
+	stats_count(STAT_REQUESTS);
+	conn->mem_len = request_format_stats(&conn->page, req->keep_alive);
+	conn->mem = conn->page;
+	req->status = 200;
+	req->bytes = conn->mem_len;
+	conn->req = req;
+	return 1;
+    }
+    if (!req->is_static) {
+	if (fcgi_is_program(req->filename)) {
+	    stats_count(STAT_REQUESTS);
+	    stats_count(STAT_FCGI);
+	    conn->req = req;
+	    if ((conn->proc = fcgi_acquire(req->filename, 0)) == NULL) {
+		conn_wait_fcgi(loop, conn);
+		return 1;
+	    }
+	    return conn_start_fcgi(loop, conn, req);
+	}
+	conn_hand_off(loop, conn, req);
+	return 0;
+    }
+    
+    // a range, or nothing at all for a 304, is sent from the disk
+    off_t offset, count;
+    int len = request_format_partial(conn->out, req, &offset, &count);
+    if (len > 0) {
+	if (count > 0) {
+	    conn->body_fd = open(req->filename, O_RDONLY | O_CLOEXEC);
+	    if (conn->body_fd < 0 || !is_resident(conn->body_fd, offset + count)) {
+		conn_hand_off(loop, conn, req);
+		return 0;
+	    }
+	}
+	stats_count(STAT_REQUESTS);
+	stats_count(STAT_STATIC);
+	conn->out_len = len;
+	conn->body_sent = offset;
+	conn->body_len = offset + count;
+	req->status = request_status(conn->out);
+	req->bytes = len + count;
+	conn->req = req;
+	return 1;
+    }
+    
+    off_t filesize = req->sbuf.st_size;
+    cache_entry_t *entry = request_cache_find(req);
+    if (entry != NULL)
+	stats_count(STAT_CACHE_HITS);
+    if (entry == NULL && req->compress) {
+	// compressing a file takes too long to do here
+	conn_hand_off(loop, conn, req);
+	return 0;
+    }
+    if (entry == NULL && filesize > 0) {
+	conn->body_fd = open(req->filename, O_RDONLY | O_CLOEXEC);
+	if (conn->body_fd < 0 || !is_resident(conn->body_fd, filesize)) {
+	    conn_hand_off(loop, conn, req);
+	    return 0;
+	}
+	// reading it from the page cache won't block either
+	if (cache_fits(filesize)) {
+	    entry = request_cache_load(req, conn->body_fd);
+	    if (entry != NULL)
+		conn_free_body(conn);
+	}
+    }
+    stats_count(STAT_REQUESTS);
+    stats_count(STAT_STATIC);
+    if (entry != NULL) {
+	// the keep-alive header is right in front of the file, so that
+	// response is one block; the close one needs its header copied
+	conn->entry = entry;
+	conn->mem_len = entry->size - entry->head_len - entry->close_len;
+	if (req->keep_alive) {
+	    conn->mem = entry->data;
+	    conn->mem_len += entry->head_len;
+	} else {
+	    conn->mem = entry->data + entry->head_len;
+	    conn->out_len = entry->close_len;
+	    memcpy(conn->out, entry->data + entry->size - entry->close_len, entry->close_len);
+	}
+    } else {
+	conn->body_len = filesize;
+	conn->out_len = request_format_static_header(conn->out, req, conn->body_len, req->keep_alive);
+    }
+    req->status = 200;
+    req->bytes = conn->out_len + conn->mem_len + conn->body_len;
+    conn->req = req;
+    return 1;
+}
+
+//
+// Reads whatever has arrived; returns 1 if conn is still ours
+//
+static int conn_read(loop_t *loop, conn_t *conn) {
+    // a pipelined request may already be in the buffer
+    if (conn_request_end(conn) > 0)
+	return conn_start_response(loop, conn);
+    while (1) {
+	ssize_t rc = read(conn->fd, conn->in + conn->in_len, MAXBUF - 1 - conn->in_len);
+	if (rc < 0 && errno == EAGAIN)
+	    return 1;
+	if (rc <= 0) {
+	    conn_close(loop, conn);
+	    return 0;
+	}
+	conn->in_len += rc;
+	conn->in[conn->in_len] = '\0';
+	if (conn_request_end(conn) > 0)
+	    return conn_start_response(loop, conn);
+	if (conn->in_len == MAXBUF - 1) {
+	    conn_close(loop, conn); // headers too long
+	    return 0;
+	}
+    }
+}
+
+static void conn_event(loop_t *loop, conn_t *conn, uint32_t events) {
+    // while a CGI process is answering (or being waited for), conn is left
+    // alone, even if the client has gone; that shows once the reply is sent
+    if (conn->proc != NULL || conn->waiting)
+	return;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+	conn_close(loop, conn);
+	return;
+    }
+    conn_unlink(loop, conn);
+    conn_link(loop, conn);
+    // answer requests until one is incomplete or the socket is full
+    while (1) {
+	if (!conn->responding && !conn_read(loop, conn))
+	    return;
+	if (!conn->responding || conn->proc != NULL || conn->waiting)
+	    return;
+	int rc = conn_write(conn);
+	if (rc == 0)
+	    return;
+	request_done(conn->req, conn->started);
+	conn->req = NULL;
+	if (rc < 0 || !conn->keep_alive) {
+	    conn_close(loop, conn);
+	    return;
+	}
+	conn_reset(conn);
+    }
+}
+
+//
+// Closes the connections that have been idle for too long
+//
+static void loop_expire(loop_t *loop) {
+    time_t now = time(NULL);
+    while (loop->oldest != NULL && now - loop->oldest->last_active >= request_idle_timeout)
+	conn_close(loop, loop->oldest);
+}
+
+//
+// Accepts everything in the backlog. The listening socket is edge-triggered,
+// so what is left there gets no new event until another client comes. Out of
+// fds, connections are taken with the spare fd and closed at once, which
+// at least tells their clients instead of leaving them there.
+//
+static void loop_accept(loop_t *loop) {
+    if (loop->spare_fd < 0)
+	loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    while (1) {
+	int fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0 && (errno == EMFILE || errno == ENFILE) && loop->spare_fd >= 0) {
+	    // out of fds is reported before an empty backlog is
+	    close_or_die(loop->spare_fd);
+	    fd = accept4(loop->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	    if (fd >= 0)
+		close_or_die(fd);
+	    loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	    if (fd < 0)
+		return;
+	    continue;
+	}
+	if (fd < 0 && (errno == ECONNABORTED || errno == EINTR))
+	    continue;
+	if (fd < 0)
+	    return; // EAGAIN once the backlog is empty
+	conn_t *conn = malloc(sizeof(conn_t));
+	assert(conn != NULL);
+	conn->fd = fd;
+	conn->accepted = stats_now();
+	stats_count(STAT_CONNECTIONS);
+	conn->served = 0;
+	conn->keep_alive = 0;
+	conn->in_len = 0;
+	conn->in[0] = '\0';
+	conn->responding = 0;
+	conn->waiting = 0;
+	conn->req = NULL;
+	conn->out_len = conn->out_sent = 0;
+	conn->entry = NULL;
+	conn->mem_len = conn->mem_sent = 0;
+	conn->proc = NULL;
+	memset(&conn->reply, 0, sizeof(conn->reply));
+	conn->page = NULL;
+	conn->body_fd = -1;
+	conn->body_len = conn->body_sent = 0;
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0);
+	conn_link(loop, conn);
+    }
+}
+
+static void *loop_run(void *arg) {
+    loop_t *loop = arg;
+    struct epoll_event events[MAXEVENTS];
+    while (1) {
+	// wake up every second to close idle connections
+	int n = epoll_wait(loop->epoll_fd, events, MAXEVENTS, 1000);
+	assert(n >= 0 || errno == EINTR);
+	for (int i = 0; i < n; i++) {
+	    uintptr_t ptr = (uintptr_t) events[i].data.ptr;
+	    if (ptr == 0)
+		loop_accept(loop);
+	    else if (ptr == (uintptr_t) loop)
+		loop_fcgi_idle(loop);
+	    else if (ptr & 1)
+		conn_fcgi_event(loop, (conn_t *) (ptr - 1));
+	    else
+		conn_event(loop, events[i].data.ptr, events[i].events);
+	}
+	loop_expire(loop);
+    }
+    return NULL;
+}
+
+//
+// Starts the event loops and runs the last one on the calling thread
+//
+void event_loops_run(int port, int loops, queue_t *helpers) {
+    // the loops' sockets share the port, but not with another server
+    check_listen_port_or_die(port);
+    for (int i = 0; i < loops; i++) {
+	loop_t *loop = malloc(sizeof(loop_t));
+	assert(loop != NULL);
+	loop->helpers = helpers;
+	loop->oldest = loop->newest = NULL;
+	loop->waiting = loop->waiting_last = NULL;
+	loop->listen_fd = open_reuseport_listen_fd_or_die(port);
+	loop->spare_fd = open_or_die("/dev/null", O_RDONLY | O_CLOEXEC, 0);
+	int flags = fcntl(loop->listen_fd, F_GETFL);
+	assert(flags >= 0 && fcntl(loop->listen_fd, F_SETFL, flags | O_NONBLOCK) == 0);
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	assert(loop->epoll_fd >= 0);
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = NULL; // marks the listening socket
+	assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev) == 0);
+	ev.data.ptr = loop; // marks the pools' eventfd
+	assert(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fcgi_event_fd(), &ev) == 0);
+	if (i == loops - 1) {
+	    loop_run(loop);
+	} else {
+	    pthread_t thread;
+	    pthread_create_or_die(&thread, NULL, loop_run, loop);
+	}
+    }
+}
@@ -0,0 +1,8 @@
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "queue.h"
+
+void event_loops_run(int port, int loops, queue_t *helpers);
+
+#endif // __EVENT_H__
@@ -0,0 +1,180 @@
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "io_helper.h"
+#include "fcgi.h"
+
+//
+// The pools of persistent CGI processes, one per program, made the first
+// time the program is asked for. A process is taken out of its pool for a
+// request and put back when the reply has been read; one that fails is
+// killed and replaced, since its socket may be out of step.
+//
+
+int fcgi_procs = 2;              // processes per program
+
+typedef struct fcgi_pool {
+    char *path;
+    fcgi_proc_t *idle;
+    struct fcgi_pool *next;
+} fcgi_pool_t;
+
+static fcgi_pool_t *pools;
+static pthread_mutex_t fcgi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fcgi_idle = PTHREAD_COND_INITIALIZER;
+static int fcgi_idle_fd = -1;
+
+int fcgi_is_program(char *filename) {
+    size_t len = strlen(filename);
+    return len >= 5 && !strcmp(filename + len - 5, ".fcgi");
+}
+
+//
+// Starts the program with one end of a new socket as its stdin. If it can't
+// be started, the server's end reads as closed, so the request fails and
+// it is tried again for the next one.
+//
+static void fcgi_spawn(fcgi_proc_t *proc) {
+    int sv[2];
+    extern char **environ;
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0);
+    proc->pid = spawn_with_fd(proc->path, sv[1], STDIN_FILENO, environ);
+    close_or_die(sv[1]);
+    proc->fd = sv[0];
+}
+
+static void fcgi_restart(fcgi_proc_t *proc) {
+    close_or_die(proc->fd);
+    if (proc->pid > 0) {
+	kill(proc->pid, SIGKILL);
+	waitpid(proc->pid, NULL, 0);
+    }
+    fcgi_spawn(proc);
+}
+
+static void fcgi_put_idle(fcgi_pool_t *pool, fcgi_proc_t *proc) {
+    proc->next = pool->idle;
+    pool->idle = proc;
+}
+
+static fcgi_pool_t *fcgi_find_pool(char *path) {
+    fcgi_pool_t *pool = pools;
+    while (pool != NULL && strcmp(pool->path, path) != 0)
+	pool = pool->next;
+    return pool;
+}
+
+//
+// A process running path, out of its pool. If none is idle, waits for one
+// or, with wait 0, returns NULL.
+//
+fcgi_proc_t *fcgi_acquire(char *path, int wait) {
+    pthread_mutex_lock_or_die(&fcgi_lock);
+    fcgi_pool_t *pool = fcgi_find_pool(path);
+    if (pool == NULL) {
+	pool = malloc(sizeof(fcgi_pool_t));
+	assert(pool != NULL);
+	pool->path = strdup(path);
+	assert(pool->path != NULL);
+	pool->idle = NULL;
+	for (int i = 0; i < fcgi_procs; i++) {
+	    fcgi_proc_t *proc = malloc(sizeof(fcgi_proc_t));
+	    assert(proc != NULL);
+	    proc->path = pool->path;
+	    fcgi_spawn(proc);
+	    fcgi_put_idle(pool, proc);
+	}
+	pool->next = pools;
+	pools = pool;
+    }
+    while (pool->idle == NULL && wait)
+	pthread_cond_wait_or_die(&fcgi_idle, &fcgi_lock);
+    fcgi_proc_t *proc = pool->idle;
+    if (proc != NULL)
+	pool->idle = proc->next;
+    pthread_mutex_unlock_or_die(&fcgi_lock);
+    
+    // an idle process has nothing to say, so anything to read (really the
+    // end of the stream) means it has exited since it was last used
+    if (proc != NULL) {
+	struct pollfd pfd = { .fd = proc->fd, .events = POLLIN };
+	if (poll(&pfd, 1, 0) != 0)
+	    fcgi_restart(proc);
+    }
+    return proc;
+}
+
+//
+// An eventfd that is written to whenever a process goes back into a pool,
+// for event loops, which can't wait on the condition variable, to watch.
+// The count is never read: with EPOLLET every write is a new event for
+// every loop watching.
+//
+int fcgi_event_fd(void) {
+    pthread_mutex_lock_or_die(&fcgi_lock);
+    if (fcgi_idle_fd < 0) {
+	fcgi_idle_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	assert(fcgi_idle_fd >= 0);
+    }
+    pthread_mutex_unlock_or_die(&fcgi_lock);
+    return fcgi_idle_fd;
+}
+
+//
+// Puts proc back in its pool; if ok is 0 it is replaced with a fresh process first
+//
+void fcgi_release(fcgi_proc_t *proc, int ok) {
+    if (!ok)
+	fcgi_restart(proc);
+    pthread_mutex_lock_or_die(&fcgi_lock);
+    fcgi_put_idle(fcgi_find_pool(proc->path), proc);
+    // the waiters may be after other programs, so wake them all
+    assert(pthread_cond_broadcast(&fcgi_idle) == 0);
+    if (fcgi_idle_fd >= 0) {
+	uint64_t one = 1;
+	assert(write(fcgi_idle_fd, &one, sizeof(one)) == sizeof(one));
+    }
+    pthread_mutex_unlock_or_die(&fcgi_lock);
+}
+
+//
+// Sends the request to an idle process. It is small enough that the empty
+// socket buffer takes it at once, so this doesn't block. Returns 0, or -1 on error.
+//
+int fcgi_send_request(fcgi_proc_t *proc, char *query) {
+    uint32_t len = strlen(query);
+    struct iovec iov[2] = { { &len, sizeof(len) }, { query, len } };
+    return sendv_all(proc->fd, iov, 2, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+//
+// Reads what has arrived of the reply. flags is passed to recv(), so
+// MSG_DONTWAIT makes it return instead of waiting. Returns 1 once the reply
+// is all in, 0 if more is to come and -1 if the process failed.
+//
+int fcgi_read_reply(fcgi_proc_t *proc, fcgi_reply_t *reply, int flags) {
+    while (reply->len_got < (int) sizeof(reply->len)) {
+	ssize_t rc = recv(proc->fd, (char *) &reply->len + reply->len_got, sizeof(reply->len) - reply->len_got, flags);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+	    return 0;
+	if (rc <= 0)
+	    return -1;
+	reply->len_got += rc;
+	if (reply->len_got == sizeof(reply->len)) {
+	    if (reply->len > FCGI_MAX_REPLY)
+		return -1;
+	    reply->data = malloc(reply->len + 1);
+	    assert(reply->data != NULL);
+	    reply->got = 0;
+	}
+    }
+    while (reply->got < reply->len) {
+	ssize_t rc = recv(proc->fd, reply->data + reply->got, reply->len - reply->got, flags);
+	if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+	    return 0;
+	if (rc <= 0)
+	    return -1;
+	reply->got += rc;
+    }
+    reply->data[reply->len] = '\0';
+    return 1;
+}
@@ -0,0 +1,47 @@
+#ifndef __FCGI_H__
+#define __FCGI_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+//
+// Persistent CGI programs, in the spirit of FastCGI. A program whose name
+// ends in .fcgi is started once, as a pool of processes, and then answers
+// request after request instead of being run for each one.
+//
+// Each process has a Unix socket as its stdin. The server sends it a
+// request as a 4-byte length (host order) followed by the query string,
+// and the program answers with a 4-byte length followed by what a CGI
+// program would print: header lines, an empty line and the body. The
+// server adds the status line, Connection and Content-Length, so the
+// connection can stay open afterwards.
+//
+typedef struct fcgi_proc {
+    int fd;                      // the server's end of the socket
+    pid_t pid;
+    char *path;
+    struct fcgi_proc *next;      // in its pool's idle list
+} fcgi_proc_t;
+
+//
+// A reply as it is read in, possibly a piece at a time
+//
+typedef struct {
+    uint32_t len;                // of data, once the length has been read
+    int len_got;                 // bytes of the length read so far
+    char *data;
+    uint32_t got;
+} fcgi_reply_t;
+
+#define FCGI_MAX_REPLY (64 << 20)
+
+extern int fcgi_procs;
+
+int fcgi_is_program(char *filename);
+fcgi_proc_t *fcgi_acquire(char *path, int wait);
+int fcgi_event_fd(void);
+void fcgi_release(fcgi_proc_t *proc, int ok);
+int fcgi_send_request(fcgi_proc_t *proc, char *query);
+int fcgi_read_reply(fcgi_proc_t *proc, fcgi_reply_t *reply, int flags);
+
+#endif // __FCGI_H__
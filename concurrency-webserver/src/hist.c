@@ -0,0 +1,61 @@
+#include <string.h>
+#include "hist.h"
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(hist_t));
+}
+
+static int hist_index(long us) {
+    if (us < 2 * HIST_SUB)
+	return us < 0 ? 0 : us;
+    // shift so the value has 7 significant bits, 64 to 127
+    int shift = 63 - __builtin_clzl(us) - 6;
+    int index = HIST_SUB * (shift + 1) + (int) (us >> shift) - HIST_SUB;
+    return index < HIST_SIZE ? index : HIST_SIZE - 1;
+}
+
+//
+// The middle of the range of values that go in bucket index
+//
+static long hist_value(int index) {
+    if (index < 2 * HIST_SUB)
+	return index;
+    int shift = index / HIST_SUB - 1;
+    long low = (long) (index % HIST_SUB + HIST_SUB) << shift;
+    return low + (1L << shift) / 2;
+}
+
+void hist_add(hist_t *h, long us) {
+    h->counts[hist_index(us)]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+	h->max = us;
+}
+
+void hist_merge(hist_t *into, hist_t *from) {
+    for (int i = 0; i < HIST_SIZE; i++)
+	into->counts[i] += from->counts[i];
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max)
+	into->max = from->max;
+}
+
+//
+// The value that p (0 to 1) of the values are at or below
+//
+long hist_percentile(hist_t *h, double p) {
+    long rank = (long) (p * h->count + 0.5);
+    if (rank < 1)
+	rank = 1;
+    long seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+	seen += h->counts[i];
+	if (seen >= rank) {
+	    long value = hist_value(i);
+	    return value < h->max ? value : h->max;
+	}
+    }
+    return h->max;
+}
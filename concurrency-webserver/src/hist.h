@@ -0,0 +1,24 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+//
+// A latency histogram with log-linear buckets: values below 128 get a
+// bucket each, and every power of two above that is split into 64, so a
+// bucket is never more than about 1.5% wide. Values are in microseconds.
+//
+#define HIST_SUB (64)
+#define HIST_SIZE (HIST_SUB * 36)  // up to 2^40 us, about 12 days
+
+typedef struct {
+    long counts[HIST_SIZE];
+    long count;
+    long max;
+    double sum;
+} hist_t;
+
+void hist_init(hist_t *h);
+void hist_add(hist_t *h, long us);
+void hist_merge(hist_t *into, hist_t *from);
+long hist_percentile(hist_t *h, double p);
+
+#endif // __HIST_H__
@@ -1,27 +1,173 @@
 #include "io_helper.h"
 
-ssize_t readline(int fd, void *buf, size_t maxlen) {
-    char c;
+void rio_init(rio_t *rp, int fd) {
+    rp->fd = fd;
+    rp->count = 0;
+    rp->next = rp->buf;
+}
+
+//
+// Makes sure there are unread bytes in the buffer, with one read() if
+// there aren't. Returns how many there are, 0 on EOF, -1 on error.
+//
+static ssize_t rio_fill(rio_t *rp) {
+    while (rp->count <= 0) {
+	ssize_t rc = read(rp->fd, rp->buf, sizeof(rp->buf));
+	if (rc < 0) {
+	    if (errno != EINTR)
+		return -1;
+	} else if (rc == 0) {
+	    return 0;
+	} else {
+	    rp->count = rc;
+	    rp->next = rp->buf;
+	}
+    }
+    return rp->count;
+}
+
+//
+// Reads a line (up to and including '\n', at most maxlen - 1 bytes) into
+// buf and null terminates it. Returns its length, 0 on EOF, -1 on error.
+//
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen) {
     char *bufp = buf;
-    int n;
-    for (n = 0; n < maxlen - 1; n++) { // leave room at end for '\0'
-	int rc;
-        if ((rc = read_or_die(fd, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break;    /* EOF, some data was read */
-        } else
-            return -1;    /* error */
+    size_t n = 0;
+    while (n + 1 < maxlen) {
+	ssize_t rc = rio_fill(rp);
+	if (rc < 0)
+	    return -1;
+	if (rc == 0)
+	    break; // EOF
+	// take everything up to the newline from the buffer at once
+	size_t avail = rp->count;
+	if (avail > maxlen - 1 - n)
+	    avail = maxlen - 1 - n;
+	char *nl = memchr(rp->next, '\n', avail);
+	size_t take = nl != NULL ? nl - rp->next + 1 : avail;
+	memcpy(bufp + n, rp->next, take);
+	rp->next += take;
+	rp->count -= take;
+	n += take;
+	if (nl != NULL)
+	    break;
     }
-    *bufp = '\0';
+    bufp[n] = '\0';
     return n;
 }
 
+//
+// Reads up to len bytes, buffered ones first. Returns how many, 0 on EOF, -1 on error.
+//
+ssize_t rio_read(rio_t *rp, void *buf, size_t len) {
+    ssize_t rc = rio_fill(rp);
+    if (rc <= 0)
+	return rc;
+    size_t take = (size_t) rp->count < len ? (size_t) rp->count : len;
+    memcpy(buf, rp->next, take);
+    rp->next += take;
+    rp->count -= take;
+    return take;
+}
+
+//
+// Sends all len bytes, however many calls it takes. Returns len, -1 on error.
+//
+ssize_t send_all(int fd, void *buf, size_t len, int flags) {
+    size_t sent = 0;
+    while (sent < len) {
+	ssize_t rc = send(fd, (char *) buf + sent, len - sent, flags);
+	if (rc < 0) {
+	    if (errno != EINTR)
+		return -1;
+	} else {
+	    sent += rc;
+	}
+    }
+    return len;
+}
+
+//
+// Sends the pieces in iov one after the other, in as few sendmsg() calls as
+// the socket allows; iov is used up as it goes. Returns the total, -1 on error.
+//
+ssize_t sendv_all(int fd, struct iovec *iov, int iovcnt, int flags) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	ssize_t rc = sendmsg(fd, &msg, flags);
+	if (rc < 0) {
+	    if (errno != EINTR)
+		return -1;
+	    continue;
+	}
+	total += rc;
+	// skip what went out: whole pieces, then part of the next one
+	while (iovcnt > 0 && (size_t) rc >= iov->iov_len) {
+	    rc -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *) iov->iov_base + rc;
+	    iov->iov_len -= rc;
+	}
+    }
+    return total;
+}
+
+//
+// Sends count bytes of in_fd, starting at offset, with sendfile() so they go
+// from the page cache to the socket without a copy through user space.
+// Returns count, -1 on error or if the file turns out to be shorter.
+//
+ssize_t sendfile_all(int out_fd, int in_fd, off_t offset, size_t count) {
+    size_t sent = 0;
+    while (sent < count) {
+	ssize_t rc = sendfile(out_fd, in_fd, &offset, count - sent);
+	if (rc < 0) {
+	    if (errno != EINTR)
+		return -1;
+	} else if (rc == 0) {
+	    return -1;
+	} else {
+	    sent += rc;
+	}
+    }
+    return count;
+}
+
+//
+// Runs filename with fd as its target_fd (e.g. its stdout) and envp as its
+// environment. posix_spawn() doesn't copy the server's page tables the way
+// fork() does, so this stays quick however big the server gets.
+// Returns the child's pid, or -1 if it couldn't be started.
+//
+pid_t spawn_with_fd(char *filename, int fd, int target_fd, char **envp) {
+    char *argv[] = { filename, NULL };
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none, pipe;
+    pid_t pid;
+    assert(posix_spawn_file_actions_init(&actions) == 0);
+    assert(posix_spawn_file_actions_adddup2(&actions, fd, target_fd) == 0);
+    // the child gets ordinary signal handling back: the server ignores
+    // SIGPIPE and may block signals for a thread of its own to take
+    sigemptyset(&none);
+    sigemptyset(&pipe);
+    sigaddset(&pipe, SIGPIPE);
+    assert(posix_spawnattr_init(&attr) == 0);
+    assert(posix_spawnattr_setsigmask(&attr, &none) == 0);
+    assert(posix_spawnattr_setsigdefault(&attr, &pipe) == 0);
+    assert(posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF) == 0);
+    int rc = posix_spawn(&pid, filename, &actions, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return rc == 0 ? pid : -1;
+}
 
 int open_client_fd(char *hostname, int port) {
     int client_fd;
@@ -46,10 +192,20 @@ int open_client_fd(char *hostname, int port) {
     return client_fd;
 }
 
-int open_listen_fd(int port) {
-    // Create a socket descriptor 
+// connections the kernel queues for accept() on a listening socket
+// (silently capped at net.core.somaxconn)
+int listen_backlog = 1024;
+
+//
+// A socket bound to port on any IP address for this host. With reuseport
+// set, any number of sockets can listen on the same port and the kernel
+// spreads new connections over them.
+//
+static int bind_fd(int port, int reuseport) {
+    // Create a socket descriptor, close-on-exec so that CGI programs
+    // don't hold the port after the server is gone
     int listen_fd;
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
 	fprintf(stderr, "socket() failed\n");
 	return -1;
     }
@@ -60,6 +216,10 @@ int open_listen_fd(int port) {
 	fprintf(stderr, "setsockopt() failed\n");
 	return -1;
     }
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, (const void *) &optval, sizeof(int)) < 0) {
+	fprintf(stderr, "setsockopt() failed\n");
+	return -1;
+    }
     
     // Listen_fd will be an endpoint for all requests to port on any IP address for this host
     struct sockaddr_in server_addr;
@@ -69,15 +229,42 @@ int open_listen_fd(int port) {
     server_addr.sin_port = htons((unsigned short) port); 
     if (bind(listen_fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0) {
 	fprintf(stderr, "bind() failed\n");
+	close(listen_fd);
 	return -1;
     }
+    return listen_fd;
+}
+
+static int open_listen_fd_common(int port, int reuseport) {
+    int listen_fd = bind_fd(port, reuseport);
+    if (listen_fd < 0)
+	return -1;
     
     // Make it a listening socket ready to accept connection requests 
-    if (listen(listen_fd, 1024) < 0) {
+    if (listen(listen_fd, listen_backlog) < 0) {
 	fprintf(stderr, "listen() failed\n");
 	return -1;
     }
     return listen_fd;
 }
 
+int open_listen_fd(int port) {
+    return open_listen_fd_common(port, 0);
+}
+
+int open_reuseport_listen_fd(int port) {
+    return open_listen_fd_common(port, 1);
+}
 
+//
+// Fails, as open_listen_fd would, if something is already listening on
+// port. A socket with SO_REUSEPORT would quietly join another server's
+// group on it and share its connections, so check before opening one.
+//
+int check_listen_port(int port) {
+    int fd = bind_fd(port, 0);
+    if (fd < 0)
+	return -1;
+    close(fd);
+    return 0;
+}
@@ -8,17 +8,22 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -78,18 +83,59 @@ typedef struct sockaddr sockaddr_t;
     ({ struct hostent *p = gethostbyname(name); assert(p != NULL); p; })
 #define gethostbyaddr_or_die(addr, len, type) \
     ({ struct hostent *p = gethostbyaddr(addr, len, type); assert(p != NULL); p; })
+#define pthread_create_or_die(thread, attr, start_routine, arg) \
+    assert(pthread_create(thread, attr, start_routine, arg) == 0);
+#define pthread_mutex_lock_or_die(mutex) \
+    assert(pthread_mutex_lock(mutex) == 0);
+#define pthread_mutex_unlock_or_die(mutex) \
+    assert(pthread_mutex_unlock(mutex) == 0);
+#define pthread_cond_wait_or_die(cond, mutex) \
+    assert(pthread_cond_wait(cond, mutex) == 0);
+#define pthread_cond_signal_or_die(cond) \
+    assert(pthread_cond_signal(cond) == 0);
+
+//
+// A buffered reader, so that reading a request or response line by line
+// takes one read() per buffer full instead of one per byte
+//
+#define RIO_BUFSIZE (16384)
+typedef struct {
+    int fd;
+    int count;               // unread bytes in buf
+    char *next;              // next unread byte
+    char buf[RIO_BUFSIZE];
+} rio_t;
+
+void rio_init(rio_t *rp, int fd);
+ssize_t rio_readline(rio_t *rp, void *buf, size_t maxlen);
+ssize_t rio_read(rio_t *rp, void *buf, size_t len);
+
+// send everything, looping over partial writes
+ssize_t send_all(int fd, void *buf, size_t len, int flags);
+ssize_t sendv_all(int fd, struct iovec *iov, int iovcnt, int flags);
+ssize_t sendfile_all(int out_fd, int in_fd, off_t offset, size_t count);
+
+pid_t spawn_with_fd(char *filename, int fd, int target_fd, char **envp);
 
 // client/server helper functions 
-ssize_t readline(int fd, void *buf, size_t maxlen);
+extern int listen_backlog;
 int open_client_fd(char *hostname, int portno);
 int open_listen_fd(int portno);
+int open_reuseport_listen_fd(int portno);
+int check_listen_port(int portno);
 
 // wrappers for above
-#define readline_or_die(fd, buf, maxlen) \
-    ({ ssize_t rc = readline(fd, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_readline_or_die(rp, buf, maxlen) \
+    ({ ssize_t rc = rio_readline(rp, buf, maxlen); assert(rc >= 0); rc; })
+#define rio_read_or_die(rp, buf, len) \
+    ({ ssize_t rc = rio_read(rp, buf, len); assert(rc >= 0); rc; })
 #define open_client_fd_or_die(hostname, port) \
     ({ int rc = open_client_fd(hostname, port); assert(rc >= 0); rc; })
 #define open_listen_fd_or_die(port) \
     ({ int rc = open_listen_fd(port); assert(rc >= 0); rc; })
+#define open_reuseport_listen_fd_or_die(port) \
+    ({ int rc = open_reuseport_listen_fd(port); assert(rc >= 0); rc; })
+#define check_listen_port_or_die(port) \
+    ({ int rc = check_listen_port(port); assert(rc == 0); rc; })
 
 #endif // __IO_HELPER__
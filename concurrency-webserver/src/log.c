@@ -0,0 +1,175 @@
+#include "io_helper.h"
+#include "log.h"
+
+//
+// Each ring has one writer (its thread) and one reader (the flusher).
+// head and tail only ever grow and are taken modulo LOG_RING; the writer
+// publishes a line by storing head after the bytes, and the flusher frees
+// space by storing tail after writing them out, so neither takes a lock.
+//
+
+#define FLUSH_INTERVAL_US (100000)
+#define MAX_RINGS (512)           // two pieces each fit in one writev()
+
+typedef struct log_ring {
+    size_t head;                  // bytes ever written in
+    size_t tail;                  // bytes ever flushed out
+    char buf[LOG_RING];
+    struct log_ring *next;
+} log_ring_t;
+
+static __thread log_ring_t *mine;
+static log_ring_t *rings;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_fd = -1;
+static char *log_format;
+
+static log_ring_t *log_mine(void) {
+    if (mine == NULL) {
+	mine = malloc(sizeof(log_ring_t));
+	assert(mine != NULL);
+	mine->head = mine->tail = 0;
+	pthread_mutex_lock_or_die(&log_lock);
+	mine->next = rings;
+	// a flusher that sees the new head of the list sees a whole ring
+	__atomic_store_n(&rings, mine, __ATOMIC_RELEASE);
+	pthread_mutex_unlock_or_die(&log_lock);
+    }
+    return mine;
+}
+
+static char *log_put(char *p, char *end, const char *s) {
+    while (*s != '\0' && p < end)
+	*p++ = *s++;
+    return p;
+}
+
+//
+// Puts the line for req into line (MAXBUF bytes) and returns its length
+//
+static int log_format_line(char *line, request_t *req, long us) {
+    char num[32];
+    char *p = line, *end = line + MAXBUF - 1;
+    for (char *f = log_format; *f != '\0' && p < end; f++) {
+	if (*f != '%' || f[1] == '\0') {
+	    *p++ = *f;
+	    continue;
+	}
+	switch (*++f) {
+	case 'm':
+	    p = log_put(p, end, req->method);
+	    break;
+	case 'u':
+	    p = log_put(p, end, req->uri);
+	    break;
+	case 'v':
+	    p = log_put(p, end, req->version);
+	    break;
+	case 's':
+	    sprintf(num, "%d", req->status);
+	    p = log_put(p, end, num);
+	    break;
+	case 'b':
+	    if (req->bytes < 0)
+		strcpy(num, "-");
+	    else
+		sprintf(num, "%lld", (long long) req->bytes);
+	    p = log_put(p, end, num);
+	    break;
+	case 't':
+	    sprintf(num, "%ld", us);
+	    p = log_put(p, end, num);
+	    break;
+	case '%':
+	    *p++ = '%';
+	    break;
+	default:
+	    p = log_put(p, end, (char []) { '%', *f, '\0' });
+	}
+    }
+    *p++ = '\n';
+    return p - line;
+}
+
+void log_request(request_t *req, long us) {
+    if (log_fd < 0)
+	return;
+    char line[MAXBUF];
+    int len = log_format_line(line, req, us);
+    log_ring_t *ring = log_mine();
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (LOG_RING - (head - tail) < (size_t) len) {
+	stats_count(STAT_LOG_DROPPED);
+	return;
+    }
+    size_t at = head % LOG_RING;
+    size_t first = LOG_RING - at < (size_t) len ? LOG_RING - at : (size_t) len;
+    memcpy(ring->buf + at, line, first);
+    memcpy(ring->buf, line + first, len - first);
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+//
+// Every FLUSH_INTERVAL_US, writes out what all the rings hold with one writev()
+//
+static void *log_flusher(void *arg) {
+    struct iovec iov[2 * MAX_RINGS];
+    log_ring_t *flushed[MAX_RINGS];
+    size_t heads[MAX_RINGS];
+    while (1) {
+	usleep(FLUSH_INTERVAL_US);
+	int n = 0, r = 0;
+	for (log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL && r < MAX_RINGS; ring = ring->next) {
+	    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	    size_t tail = ring->tail;
+	    if (head == tail)
+		continue;
+	    // the bytes may wrap around the end of the ring
+	    size_t at = tail % LOG_RING;
+	    size_t first = LOG_RING - at < head - tail ? LOG_RING - at : head - tail;
+	    iov[n].iov_base = ring->buf + at;
+	    iov[n++].iov_len = first;
+	    if (first < head - tail) {
+		iov[n].iov_base = ring->buf;
+		iov[n++].iov_len = head - tail - first;
+	    }
+	    flushed[r] = ring;
+	    heads[r++] = head;
+	}
+	if (n == 0)
+	    continue;
+	// a log file that can't be written to just loses the lines
+	for (struct iovec *v = iov; n > 0; ) {
+	    ssize_t rc = writev(log_fd, v, n);
+	    if (rc < 0 && errno == EINTR)
+		continue;
+	    if (rc <= 0)
+		break;
+	    while (n > 0 && (size_t) rc >= v->iov_len) {
+		rc -= v->iov_len;
+		v++;
+		n--;
+	    }
+	    if (n > 0) {
+		v->iov_base = (char *) v->iov_base + rc;
+		v->iov_len -= rc;
+	    }
+	}
+	for (int i = 0; i < r; i++)
+	    __atomic_store_n(&flushed[i]->tail, heads[i], __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+//
+// Starts logging to fd in format; with an fd below 0 nothing is logged
+//
+void log_init(int fd, char *format) {
+    log_fd = fd;
+    log_format = format;
+    if (log_fd >= 0) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, log_flusher, NULL);
+    }
+}
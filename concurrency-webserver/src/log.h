@@ -0,0 +1,23 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "request.h"
+
+//
+// The access log. A served request is written as one line into a ring
+// buffer of the serving thread's own, and a background thread moves what
+// the rings hold to the log file every so often, in one large write. A
+// thread whose ring is full drops the line (counted in the stats) rather
+// than wait for the disk.
+//
+// The format is copied as is, except for
+//   %m method   %u uri   %v version   %s status
+//   %b bytes sent ('-' if not known)   %t service time in microseconds   %% a %
+//
+#define LOG_RING (1 << 20)
+#define LOG_DEFAULT_FORMAT "method:%m uri:%u version:%v status:%s bytes:%b us:%t"
+
+void log_init(int fd, char *format);
+void log_request(request_t *req, long us);
+
+#endif // __LOG_H__
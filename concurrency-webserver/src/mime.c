@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <string.h>
+#include "mime.h"
+
+//
+// The extensions are in a perfect hash table: each one has a slot of its
+// own, worked out by the compiler from the extension's first, second and
+// last characters and its length, so a lookup is one hash and one
+// comparison. Two extensions in the same slot would be a duplicate
+// initializer, which is made an error below. Adding one means finding a
+// MIME_MULT that still keeps them all apart (a few million random odd
+// numbers are plenty to try), or growing the table.
+//
+#pragma GCC diagnostic error "-Woverride-init"
+
+#define MIME_BITS (6)
+#define MIME_SLOTS (1 << MIME_BITS)
+#define MIME_MULT (0x18425821u)
+#define MIME_MAX_EXT (8)
+
+#define MIME_SLOT(c0, c1, cl, len) \
+    ((uint32_t) (((uint32_t) (c0) | (uint32_t) (c1) << 8 | (uint32_t) (cl) << 16 | (uint32_t) (len) << 24) * MIME_MULT) >> (32 - MIME_BITS))
+
+// ext, its first, second and last characters, type, compressible, program
+#define MIME(ext, c0, c1, cl, type, compressible, program) \
+    [MIME_SLOT(c0, c1, cl, sizeof(ext) - 1)] = { ext, type, compressible, program }
+
+static const mime_t mime_table[MIME_SLOTS] = {
+    MIME("html",  'h', 't', 'l', "text/html", 1, 0),
+    MIME("htm",   'h', 't', 'm', "text/html", 1, 0),
+    MIME("css",   'c', 's', 's', "text/css", 1, 0),
+    MIME("js",    'j', 's', 's', "text/javascript", 1, 0),
+    MIME("mjs",   'm', 'j', 's', "text/javascript", 1, 0),
+    MIME("json",  'j', 's', 'n', "application/json", 1, 0),
+    MIME("xml",   'x', 'm', 'l', "application/xml", 1, 0),
+    MIME("txt",   't', 'x', 't', "text/plain", 1, 0),
+    MIME("csv",   'c', 's', 'v', "text/csv", 1, 0),
+    MIME("md",    'm', 'd', 'd', "text/markdown", 1, 0),
+    MIME("svg",   's', 'v', 'g', "image/svg+xml", 1, 0),
+    MIME("gif",   'g', 'i', 'f', "image/gif", 0, 0),
+    MIME("jpg",   'j', 'p', 'g', "image/jpeg", 0, 0),
+    MIME("jpeg",  'j', 'p', 'g', "image/jpeg", 0, 0),
+    MIME("png",   'p', 'n', 'g', "image/png", 0, 0),
+    MIME("ico",   'i', 'c', 'o', "image/x-icon", 0, 0),
+    MIME("webp",  'w', 'e', 'p', "image/webp", 0, 0),
+    MIME("avif",  'a', 'v', 'f', "image/avif", 0, 0),
+    MIME("pdf",   'p', 'd', 'f', "application/pdf", 0, 0),
+    MIME("wasm",  'w', 'a', 'm', "application/wasm", 0, 0),
+    MIME("zip",   'z', 'i', 'p', "application/zip", 0, 0),
+    MIME("gz",    'g', 'z', 'z', "application/gzip", 0, 0),
+    MIME("mp4",   'm', 'p', '4', "video/mp4", 0, 0),
+    MIME("webm",  'w', 'e', 'm', "video/webm", 0, 0),
+    MIME("mp3",   'm', 'p', '3', "audio/mpeg", 0, 0),
+    MIME("ogg",   'o', 'g', 'g', "audio/ogg", 0, 0),
+    MIME("wav",   'w', 'a', 'v', "audio/wav", 0, 0),
+    MIME("woff",  'w', 'o', 'f', "font/woff", 0, 0),
+    MIME("woff2", 'w', 'o', '2', "font/woff2", 0, 0),
+    MIME("ttf",   't', 't', 'f', "font/ttf", 0, 0),
+    MIME("otf",   'o', 't', 'f', "font/otf", 0, 0),
+    MIME("cgi",   'c', 'g', 'i', "text/html", 0, 1),
+    MIME("fcgi",  'f', 'c', 'i', "text/html", 0, 1),
+};
+
+// files with no extension, or one that isn't in the table
+static const mime_t mime_default = { "", "text/plain", 0, 0 };
+
+//
+// The entry for the extension of filename: what follows the last '.' in
+// its last component, in any case
+//
+const mime_t *mime_lookup(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    const char *dot = strrchr(slash != NULL ? slash : filename, '.');
+    if (dot == NULL)
+	return &mime_default;
+    char ext[MIME_MAX_EXT + 1];
+    size_t len = 0;
+    for (const char *p = dot + 1; *p != '\0'; p++) {
+	if (len == MIME_MAX_EXT)
+	    return &mime_default;
+	char c = *p;
+	ext[len++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    ext[len] = '\0';
+    if (len == 0)
+	return &mime_default;
+    const mime_t *mime = &mime_table[MIME_SLOT(ext[0], ext[1], ext[len - 1], len)];
+    if (mime->ext == NULL || strcmp(mime->ext, ext) != 0)
+	return &mime_default;
+    return mime;
+}
@@ -0,0 +1,18 @@
+#ifndef __MIME_H__
+#define __MIME_H__
+
+//
+// What a file is, going by its extension: the Content-Type to send it
+// with, whether it is worth compressing, and whether it is a CGI program
+// rather than something to send.
+//
+typedef struct {
+    const char *ext;
+    const char *type;
+    int compressible;
+    int program;
+} mime_t;
+
+const mime_t *mime_lookup(const char *filename);
+
+#endif // __MIME_H__
@@ -0,0 +1,82 @@
+#include "io_helper.h"
+#include "queue.h"
+
+//
+// Returns 0 and sets policy if name is FIFO, SFF or SFFA, -1 otherwise
+//
+int queue_parse_policy(char *name, policy_t *policy) {
+    if (!strcasecmp(name, "FIFO"))
+	*policy = POLICY_FIFO;
+    else if (!strcasecmp(name, "SFF"))
+	*policy = POLICY_SFF;
+    else if (!strcasecmp(name, "SFFA"))
+	*policy = POLICY_SFFA;
+    else
+	return -1;
+    return 0;
+}
+
+void queue_init(queue_t *q, int size, policy_t policy) {
+    q->entries = malloc(size * sizeof(queue_entry_t));
+    assert(q->entries != NULL);
+    q->size = size;
+    q->count = 0;
+    q->policy = policy;
+    // with a full buffer, a request can be passed over by everything
+    // behind it about twice before it is forced to the front
+    q->max_skips = 2 * size;
+    assert(pthread_mutex_init(&q->lock, NULL) == 0);
+    assert(pthread_cond_init(&q->not_empty, NULL) == 0);
+    assert(pthread_cond_init(&q->not_full, NULL) == 0);
+}
+
+//
+// Adds a request, waiting for a free slot if the buffer is full
+//
+void queue_put(queue_t *q, request_t *req) {
+    pthread_mutex_lock_or_die(&q->lock);
+    while (q->count == q->size)
+	pthread_cond_wait_or_die(&q->not_full, &q->lock);
+    req->t_queued = stats_now();
+    q->entries[q->count].req = req;
+    q->entries[q->count].skips = 0;
+    q->count++;
+    pthread_cond_signal_or_die(&q->not_empty);
+    pthread_mutex_unlock_or_die(&q->lock);
+}
+
+//
+// Index of the entry the policy picks; the caller holds the lock
+//
+static int queue_pick(queue_t *q) {
+    if (q->policy == POLICY_FIFO)
+	return 0;
+    if (q->policy == POLICY_SFFA && q->entries[0].skips > q->max_skips)
+	return 0; // the oldest entry has always been skipped the most
+    int best = 0;
+    for (int i = 1; i < q->count; i++) {
+	if (q->entries[i].req->size < q->entries[best].req->size)
+	    best = i;
+    }
+    return best;
+}
+
+//
+// Removes the request the policy picks, waiting for one if the buffer is empty
+//
+request_t *queue_get(queue_t *q) {
+    pthread_mutex_lock_or_die(&q->lock);
+    while (q->count == 0)
+	pthread_cond_wait_or_die(&q->not_empty, &q->lock);
+    int i = queue_pick(q);
+    request_t *req = q->entries[i].req;
+    // everything older than the picked entry was passed over
+    for (int j = 0; j < i; j++)
+	q->entries[j].skips++;
+    memmove(&q->entries[i], &q->entries[i + 1], (q->count - i - 1) * sizeof(queue_entry_t));
+    q->count--;
+    pthread_cond_signal_or_die(&q->not_full);
+    pthread_mutex_unlock_or_die(&q->lock);
+    stats_time(STAT_QUEUE_WAIT, stats_now() - req->t_queued);
+    return req;
+}
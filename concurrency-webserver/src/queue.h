@@ -0,0 +1,43 @@
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <pthread.h>
+#include "request.h"
+
+//
+// Which waiting request a worker gets:
+//   FIFO: the oldest one
+//   SFF:  the one for the smallest file (oldest first among equals)
+//   SFFA: like SFF, but a request that has been passed over more than
+//         max_skips times goes first, so big files can't starve
+//
+typedef enum { POLICY_FIFO, POLICY_SFF, POLICY_SFFA } policy_t;
+
+typedef struct {
+    request_t *req;
+    int skips;  // times a newer request was served first
+} queue_entry_t;
+
+//
+// A fixed-size buffer of read requests, shared by the master
+// thread (which puts) and the worker threads (which get).
+// Entries are kept in arrival order. FIFO doesn't look at them, so
+// with it they are connections whose first request isn't read yet.
+//
+typedef struct {
+    queue_entry_t *entries;
+    int size;   // number of slots
+    int count;  // slots in use
+    policy_t policy;
+    int max_skips;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} queue_t;
+
+int queue_parse_policy(char *name, policy_t *policy);
+void queue_init(queue_t *q, int size, policy_t policy);
+void queue_put(queue_t *q, request_t *req);
+request_t *queue_get(queue_t *q);
+
+#endif // __QUEUE_H__
@@ -1,180 +1,1036 @@
+#define _GNU_SOURCE // for memmem
+#include <poll.h>
+#include <time.h>
+#include <zlib.h>
 #include "io_helper.h"
 #include "request.h"
+#include "log.h"
+#include "mime.h"
 
 //
 // Some of this code stolen from Bryant/O'Halloran
 // Hopefully this is not a problem ... :)
 //
 
-#define MAXBUF (8192)
+int request_max_per_conn = 100;  // requests served on one connection before it is closed
+int request_idle_timeout = 5;    // seconds a kept-alive connection may sit idle
+int request_max_cgi = 16;        // CGI programs run at once; more requests wait their turn
+int request_compress = 0;        // 1 to gzip text files into the cache for clients that take it
+#define MAX_COMPRESS_SIZE (1L << 30) // bytes; zlib counts in 32 bits, so it has to stay under 4GB
+
+static int cgi_running;
+static pthread_mutex_t cgi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cgi_done = PTHREAD_COND_INITIALIZER;
+
+//
+// Responses are put together from constant fragments with memcpy(), rather
+// than by having sprintf() parse a format string for every response
+//
+#define SERVER_HEADER "Server: OSTEP WebServer\r\n"
+#define put_const(p, s) put(p, s, sizeof(s) - 1)
+
+static char *put(char *p, const char *s, size_t len) {
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *put_str(char *p, const char *s) {
+    return put(p, s, strlen(s));
+}
+
+static char *put_num(char *p, unsigned long long n) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+	digits[--i] = '0' + n % 10;
+	n /= 10;
+    } while (n > 0);
+    return put(p, digits + i, sizeof(digits) - i);
+}
+
+static char *put_hex(char *p, unsigned long long n) {
+    char digits[24];
+    int i = sizeof(digits);
+    do {
+	digits[--i] = "0123456789abcdef"[n % 16];
+	n /= 16;
+    } while (n > 0);
+    return put(p, digits + i, sizeof(digits) - i);
+}
+
+static char *put_connection(char *p, int keep_alive) {
+    if (keep_alive)
+	return put_const(p, "Connection: keep-alive\r\n");
+    return put_const(p, "Connection: close\r\n");
+}
+
+//
+// Puts a whole error response (header and body) into buf, which must hold
+// MAXERROR bytes, and returns its length
+//
+int request_format_error(char *buf, int keep_alive, char *cause, char *errnum, char *shortmsg, char *longmsg) {
+    char body[MAXBUF], *p = body;
+    
+    // Create the body of error message first (have to know its length for header).
+    // cause comes from the request, so only so much of it is shown.
+    p = put_const(p, ""
+		  "<!doctype html>\r\n"
+		  "<head>\r\n"
+		  "  <title>OSTEP WebServer Error</title>\r\n"
+		  "</head>\r\n"
+		  "<body>\r\n"
+		  "  <h2>");
+    p = put_str(p, errnum);
+    p = put_const(p, ": ");
+    p = put_str(p, shortmsg);
+    p = put_const(p, "</h2>\r\n  <p>");
+    p = put_str(p, longmsg);
+    p = put_const(p, ": ");
+    p = put(p, cause, strnlen(cause, MAXBUF / 2));
+    p = put_const(p, ""
+		  "</p>\r\n"
+		  "</body>\r\n"
+		  "</html>\r\n");
+    
+    // Then the header information for this response, with the body last
+    char *q = buf;
+    q = put_const(q, "HTTP/1.1 ");
+    q = put_str(q, errnum);
+    q = put_const(q, " ");
+    q = put_str(q, shortmsg);
+    q = put_const(q, "\r\n");
+    q = put_connection(q, keep_alive);
+    q = put_const(q, "Content-Type: text/html\r\nContent-Length: ");
+    q = put_num(q, p - body);
+    q = put_const(q, "\r\n\r\n");
+    q = put(q, body, p - body);
+    return q - buf;
+}
 
 void request_error(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg) {
-    char buf[MAXBUF], body[MAXBUF];
+    char buf[MAXERROR];
+    int len = request_format_error(buf, 0, cause, errnum, shortmsg, longmsg);
+    send_all(fd, buf, len, MSG_NOSIGNAL);
+}
+
+//
+// 1 if an Accept-Encoding list has gzip (or *) in it, without q=0
+//
+static int request_accepts_gzip(char *list) {
+    for (char *p = list; *p != '\0'; ) {
+	while (*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	size_t n = strcspn(p, ",; \t");
+	int gzip = (n == 4 && !strncasecmp(p, "gzip", 4)) || (n == 6 && !strncasecmp(p, "x-gzip", 6)) || (n == 1 && *p == '*');
+	p += n;
+	char *params = p;
+	p += strcspn(p, ",");
+	if (!gzip)
+	    continue;
+	char *q = strstr(params, "q=");
+	if (q == NULL || q > p || strtod(q + 2, NULL) > 0)
+	    return 1;
+    }
+    return 0;
+}
+
+//
+// Takes what the server needs from one header; the rest are ignored
+//
+void request_parse_header(request_t *req, char *name, char *value) {
+    if (!strcasecmp(name, "Connection")) {
+	if (!strcasecmp(value, "close"))
+	    req->keep_alive = 0;
+	else if (!strcasecmp(value, "keep-alive"))
+	    req->keep_alive = 1;
+    } else if (!strcasecmp(name, "Range")) {
+	req->range = value;
+    } else if (!strcasecmp(name, "If-Range")) {
+	req->if_range = value;
+    } else if (!strcasecmp(name, "If-None-Match")) {
+	req->if_none_match = value;
+    } else if (!strcasecmp(name, "If-Modified-Since")) {
+	req->if_modified_since = value;
+    } else if (!strcasecmp(name, "Accept-Encoding")) {
+	req->accept_gzip = request_accepts_gzip(value);
+    }
+}
+
+//
+// Cuts the line at *p off in place, without its line ending, and moves
+// *p to the next line
+//
+static char *request_next_line(char **p) {
+    char *line = *p;
+    char *eol = strchr(line, '\n');
+    if (eol != NULL) {
+	*p = eol + 1;
+	*eol = '\0';
+    } else {
+	*p = line + strlen(line);
+    }
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\r')
+	line[len - 1] = '\0';
+    return line;
+}
+
+//
+// Splits req->head in place: the request line into method, uri and
+// version, and every header line up to an empty one into name and value
+//
+static void request_tokenize(request_t *req) {
+    char *p = req->head;
+    char *line = request_next_line(&p);
+    while (*line == '\0' && *p != '\0')
+	line = request_next_line(&p); // empty lines before the request line are ignored
+    char *save;
+    req->method = strtok_r(line, " \t", &save);
+    req->uri = req->method != NULL ? strtok_r(NULL, " \t", &save) : NULL;
+    req->version = req->uri != NULL ? strtok_r(NULL, " \t", &save) : NULL;
+    req->method = req->method != NULL ? req->method : "";
+    req->uri = req->uri != NULL ? req->uri : "";
+    req->version = req->version != NULL ? req->version : "";
     
-    // Create the body of error message first (have to know its length for header)
-    sprintf(body, ""
-	    "<!doctype html>\r\n"
-	    "<head>\r\n"
-	    "  <title>OSTEP WebServer Error</title>\r\n"
-	    "</head>\r\n"
-	    "<body>\r\n"
-	    "  <h2>%s: %s</h2>\r\n" 
-	    "  <p>%s: %s</p>\r\n"
-	    "</body>\r\n"
-	    "</html>\r\n", errnum, shortmsg, longmsg, cause);
+    // HTTP/1.1 connections stay open unless the client says otherwise
+    req->keep_alive = !strcmp(req->version, "HTTP/1.1");
+    while (*p != '\0') {
+	line = request_next_line(&p);
+	if (*line == '\0')
+	    break;
+	char *value = strchr(line, ':');
+	if (value == NULL)
+	    continue;
+	*value++ = '\0';
+	while (*value == ' ' || *value == '\t')
+	    value++;
+	request_parse_header(req, line, value);
+    }
+}
+
+typedef enum { ROUTE_STATIC, ROUTE_CGI, ROUTE_STATS } route_t;
+
+//
+// Where a path goes, by how it starts. The first entry that matches wins;
+// a prefix that doesn't end in '/' has to be the whole path. A path that
+// none match is a static file, unless its extension makes it a CGI
+// program (see mime.c).
+//
+#define ROUTE(prefix, route) { prefix, sizeof(prefix) - 1, route }
+
+static const struct {
+    const char *prefix;
+    size_t len;
+    route_t route;
+} routes[] = {
+    ROUTE(STATS_URI, ROUTE_STATS),
+    ROUTE("/cgi-bin/", ROUTE_CGI),
+};
+
+static route_t request_route(char *path, size_t len) {
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+	size_t n = routes[i].len;
+	if (len >= n && !memcmp(path, routes[i].prefix, n) && (routes[i].prefix[n - 1] == '/' || len == n))
+	    return routes[i].route;
+    }
+    return ROUTE_STATIC;
+}
+
+//
+// Works out from the uri where the request goes, and fills in its
+// filename and cgiargs (the query string, which a static file ignores)
+//
+static route_t request_parse_uri(request_t *req) {
+    char *uri = req->uri;
+    size_t len = strcspn(uri, "?");
+    snprintf(req->cgiargs, MAXBUF, "%s", uri[len] == '?' ? uri + len + 1 : "");
+    snprintf(req->filename, MAXBUF, ".%.*s", (int) len, uri);
     
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    write_or_die(fd, buf, strlen(buf));
+    route_t route = request_route(uri, len);
+    if (route == ROUTE_STATIC && mime_lookup(req->filename)->program)
+	route = ROUTE_CGI;
+    if (route == ROUTE_STATIC && len > 0 && uri[len - 1] == '/' &&
+	strlen(req->filename) + strlen("index.html") < MAXBUF)
+	strcat(req->filename, "index.html");
+    return route;
+}
+
+//
+// The type of what req's file holds; a .gz sibling sent in place of a
+// file holds that file, encoded
+//
+static const char *request_content_type(request_t *req) {
+    if (req->gzip && !req->compress) {
+	char name[MAXBUF];
+	strcpy(name, req->filename);
+	name[strlen(name) - strlen(".gz")] = '\0';
+	return mime_lookup(name)->type;
+    }
+    return mime_lookup(req->filename)->type;
+}
+
+//
+// Whether a file is worth compressing, by its type, and small enough to
+// (under MAX_COMPRESS_SIZE)
+//
+static int request_compressible(request_t *req) {
+    return mime_lookup(req->filename)->compressible && req->sbuf.st_size < MAX_COMPRESS_SIZE;
+}
+
+//
+// For a client that takes gzip, picks the encoded file: a .gz sibling of
+// the file if there is one, or (with -z) the file itself compressed into
+// the cache, if it is text and fits there. Ranges are of the file as it is.
+//
+static void request_choose_encoding(request_t *req) {
+    char gz[MAXBUF + 4];
+    struct stat sbuf;
+    sprintf(gz, "%s.gz", req->filename);
+    if (strlen(gz) < MAXBUF && stat(gz, &sbuf) == 0 && S_ISREG(sbuf.st_mode) && (S_IRUSR & sbuf.st_mode)) {
+	strcpy(req->filename, gz);
+	req->sbuf = sbuf;
+	req->size = sbuf.st_size;
+	req->gzip = 1;
+    } else if (request_compress && req->range == NULL && cache_fits(req->sbuf.st_size) && request_compressible(req)) {
+	req->gzip = req->compress = 1;
+    }
+}
+
+//
+// The server's environment with QUERY_STRING set to cgiargs, in a new
+// array. QUERY_STRING comes first, so it is envp[0] that has to be freed.
+//
+static char **request_cgi_env(char *cgiargs) {
+    extern char **environ;                       // defined by libc 
+    int n = 0;
+    while (environ[n] != NULL)
+	n++;
+    char **envp = malloc((n + 2) * sizeof(char *));
+    char *query = malloc(strlen("QUERY_STRING=") + strlen(cgiargs) + 1);
+    assert(envp != NULL && query != NULL);
+    strcpy(query, "QUERY_STRING=");
+    strcat(query, cgiargs);                      // args to cgi go here
+    int i = 0;
+    envp[i++] = query;
+    for (char **e = environ; *e != NULL; e++) {
+	if (strncmp(*e, "QUERY_STRING=", 13) != 0)
+	    envp[i++] = *e;
+    }
+    envp[i] = NULL;
+    return envp;
+}
+
+void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
+    // The server does only a little bit of the header.  
+    // The CGI script has to finish writing out the header.
+    // We can't tell where the output of the CGI program ends, so
+    // the connection closes after it
+    static const char head[] = ""
+	"HTTP/1.1 200 OK\r\n"
+	SERVER_HEADER
+	"Connection: close\r\n";
     
-    sprintf(buf, "Content-Type: text/html\r\n");
-    write_or_die(fd, buf, strlen(buf));
+    // only so many CGI programs run at once
+    pthread_mutex_lock_or_die(&cgi_lock);
+    while (request_max_cgi > 0 && cgi_running >= request_max_cgi)
+	pthread_cond_wait_or_die(&cgi_done, &cgi_lock);
+    cgi_running++;
+    pthread_mutex_unlock_or_die(&cgi_lock);
     
-    sprintf(buf, "Content-Length: %lu\r\n\r\n", strlen(body));
-    write_or_die(fd, buf, strlen(buf));
+    // make cgi writes go to socket (not screen), and wait for this child
+    // only: others are running for other threads, or are persistent programs.
+    // If the client has gone already there is nobody to run it for.
+    if (send_all(fd, (void *) head, sizeof(head) - 1, MSG_NOSIGNAL) == sizeof(head) - 1) {
+	char **envp = request_cgi_env(cgiargs);
+	pid_t pid = spawn_with_fd(filename, fd, STDOUT_FILENO, envp);
+	if (pid > 0)
+	    assert(waitpid(pid, NULL, 0) == pid);
+	free(envp[0]);
+	free(envp);
+    }
     
-    // Write out the body last
-    write_or_die(fd, body, strlen(body));
+    pthread_mutex_lock_or_die(&cgi_lock);
+    cgi_running--;
+    pthread_cond_signal_or_die(&cgi_done);
+    pthread_mutex_unlock_or_die(&cgi_lock);
 }
 
 //
-// Reads and discards everything up to an empty text line
+// The validators of a file: its ETag, made from its inode, modification time
+// and size, which changes whenever the file does, and its Last-Modified date.
+// The file compressed is another representation, so it gets its own ETag.
 //
-void request_read_headers(int fd) {
-    char buf[MAXBUF];
+static char *put_etag(char *p, request_t *req) {
+    struct stat *sbuf = &req->sbuf;
+    p = put_const(p, "\"");
+    p = put_hex(p, sbuf->st_ino);
+    p = put_const(p, "-");
+    p = put_hex(p, sbuf->st_mtim.tv_sec * 1000000000ULL + sbuf->st_mtim.tv_nsec);
+    p = put_const(p, "-");
+    p = put_hex(p, sbuf->st_size);
+    if (req->compress)
+	p = put_const(p, "-gz");
+    return put_const(p, "\"");
+}
+
+static char *put_date(char *p, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return p + strftime(p, 64, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+//
+// The validators and, as the file may also be sent gzip encoded, the
+// headers that say which encoding this is
+//
+static char *put_validators(char *p, request_t *req) {
+    p = put_const(p, "ETag: ");
+    p = put_etag(p, req);
+    p = put_const(p, "\r\nLast-Modified: ");
+    p = put_date(p, req->sbuf.st_mtim.tv_sec);
+    p = put_const(p, "\r\nVary: Accept-Encoding\r\n");
+    if (req->gzip)
+	p = put_const(p, "Content-Encoding: gzip\r\n");
+    return p;
+}
+
+//
+// Puts the response header for req's file, len bytes of it as sent, into
+// buf and returns its length
+//
+int request_format_static_header(char *buf, request_t *req, off_t len, int keep_alive) {
+    char *p = buf;
     
-    readline_or_die(fd, buf, MAXBUF);
-    while (strcmp(buf, "\r\n")) {
-	readline_or_die(fd, buf, MAXBUF);
+    p = put_const(p, "HTTP/1.1 200 OK\r\n" SERVER_HEADER);
+    p = put_connection(p, keep_alive);
+    p = put_validators(p, req);
+    p = put_const(p, "Accept-Ranges: bytes\r\nContent-Length: ");
+    p = put_num(p, len);
+    p = put_const(p, "\r\nContent-Type: ");
+    p = put_str(p, request_content_type(req));
+    p = put_const(p, "\r\n\r\n");
+    return p - buf;
+}
+
+//
+// 1 if the If-None-Match list has the file's ETag in it, or is "*".
+// A weak tag (W/) counts, as revalidating only needs the weak comparison.
+//
+static int request_etag_matches(char *list, request_t *req) {
+    char etag[64];
+    int len = put_etag(etag, req) - etag;
+    for (char *p = list; *p != '\0'; ) {
+	while (*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	if (!strncmp(p, "W/", 2))
+	    p += 2;
+	size_t n = strcspn(p, ", \t");
+	if ((n == 1 && *p == '*') || (n == (size_t) len && !strncmp(p, etag, len)))
+	    return 1;
+	p += n;
     }
-    return;
+    return 0;
 }
 
 //
-// Return 1 if static, 0 if dynamic content
-// Calculates filename (and cgiargs, for dynamic) from uri
+// 1 if the file hasn't changed since the date, in the one format servers
+// send (which is what a client hands back)
 //
-int request_parse_uri(char *uri, char *filename, char *cgiargs) {
-    char *ptr;
-    
-    if (!strstr(uri, "cgi")) { 
-	// static
-	strcpy(cgiargs, "");
-	sprintf(filename, ".%s", uri);
-	if (uri[strlen(uri)-1] == '/') {
-	    strcat(filename, "index.html");
-	}
+static int request_not_modified_since(char *date, struct stat *sbuf) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return end != NULL && sbuf->st_mtim.tv_sec <= timegm(&tm);
+}
+
+//
+// 1 if the If-Range value, an ETag or a date, is still the file's. Only
+// the strong ETag or the exact Last-Modified date will do.
+//
+static int request_range_current(char *value, request_t *req) {
+    char validator[64];
+    int len = (value[0] == '"' ? put_etag(validator, req) : put_date(validator, req->sbuf.st_mtim.tv_sec)) - validator;
+    return strlen(value) == (size_t) len && !strncmp(value, validator, len);
+}
+
+//
+// Works out the one byte range in a Range header ("bytes=first-last",
+// "bytes=first-" or "bytes=-suffix") of a file of size bytes. Returns 1
+// with *offset and *count set, -1 if the range is past the end of the
+// file, and 0 if the header should be ignored (malformed, or more than one
+// range, which the whole file will do for).
+//
+static int request_parse_range(char *range, off_t size, off_t *offset, off_t *count) {
+    if (strncasecmp(range, "bytes=", 6) || strchr(range, ',') != NULL)
+	return 0;
+    char *p = range + 6, *end;
+    if (*p == '-') {
+	if (!isdigit(p[1]))
+	    return 0;
+	long long suffix = strtoll(p + 1, &end, 10);
+	if (*end != '\0')
+	    return 0;
+	if (suffix == 0 || size == 0)
+	    return -1;
+	*count = suffix < size ? suffix : size;
+	*offset = size - *count;
 	return 1;
-    } else { 
-	// dynamic
-	ptr = index(uri, '?');
-	if (ptr) {
-	    strcpy(cgiargs, ptr+1);
-	    *ptr = '\0';
-	} else {
-	    strcpy(cgiargs, "");
-	}
-	sprintf(filename, ".%s", uri);
+    }
+    if (!isdigit(*p))
+	return 0;
+    long long first = strtoll(p, &end, 10), last = size - 1;
+    if (*end++ != '-')
 	return 0;
+    if (*end != '\0') {
+	if (!isdigit(*end))
+	    return 0;
+	last = strtoll(end, &end, 10);
+	if (*end != '\0' || last < first)
+	    return 0;
     }
+    if (first >= size)
+	return -1;
+    if (last >= size)
+	last = size - 1;
+    *offset = first;
+    *count = last - first + 1;
+    return 1;
 }
 
 //
-// Fills in the filetype given the filename
+// If the request's conditional or Range headers call for something other
+// than the whole file, puts the header of that response into buf (MAXBUF
+// bytes) and returns its length: a 304 when the client's copy is current,
+// a 206 for a byte range or a 416 for a range the file doesn't have. The
+// part of the file that follows it (nothing for a 304 or 416) is *count
+// bytes from *offset. Returns 0 if the whole file is to be sent.
 //
-void request_get_filetype(char *filename, char *filetype) {
-    if (strstr(filename, ".html")) 
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif")) 
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".jpg")) 
-	strcpy(filetype, "image/jpeg");
-    else 
-	strcpy(filetype, "text/plain");
+int request_format_partial(char *buf, request_t *req, off_t *offset, off_t *count) {
+    struct stat *sbuf = &req->sbuf;
+    char *p = buf;
+    *offset = *count = 0;
+    // If-Modified-Since only counts if there is no If-None-Match
+    if (req->if_none_match != NULL ? request_etag_matches(req->if_none_match, req)
+	: req->if_modified_since != NULL && request_not_modified_since(req->if_modified_since, sbuf)) {
+	p = put_const(p, "HTTP/1.1 304 Not Modified\r\n" SERVER_HEADER);
+	p = put_connection(p, req->keep_alive);
+	p = put_validators(p, req);
+	p = put_const(p, "\r\n");
+	return p - buf;
+    }
+    if (req->range == NULL || (req->if_range != NULL && !request_range_current(req->if_range, req)))
+	return 0;
+    int rc = request_parse_range(req->range, sbuf->st_size, offset, count);
+    if (rc == 0)
+	return 0;
+    if (rc < 0) {
+	p = put_const(p, "HTTP/1.1 416 Range Not Satisfiable\r\n" SERVER_HEADER);
+	p = put_connection(p, req->keep_alive);
+	p = put_const(p, "Content-Range: bytes */");
+	p = put_num(p, sbuf->st_size);
+	p = put_const(p, "\r\nContent-Length: 0\r\n\r\n");
+	return p - buf;
+    }
+    p = put_const(p, "HTTP/1.1 206 Partial Content\r\n" SERVER_HEADER);
+    p = put_connection(p, req->keep_alive);
+    p = put_validators(p, req);
+    p = put_const(p, "Content-Range: bytes ");
+    p = put_num(p, *offset);
+    p = put_const(p, "-");
+    p = put_num(p, *offset + *count - 1);
+    p = put_const(p, "/");
+    p = put_num(p, sbuf->st_size);
+    p = put_const(p, "\r\nContent-Length: ");
+    p = put_num(p, *count);
+    p = put_const(p, "\r\nContent-Type: ");
+    p = put_str(p, request_content_type(req));
+    p = put_const(p, "\r\n\r\n");
+    return p - buf;
 }
 
-void request_serve_dynamic(int fd, char *filename, char *cgiargs) {
-    char buf[MAXBUF], *argv[] = { NULL };
-    
-    // The server does only a little bit of the header.  
-    // The CGI script has to finish writing out the header.
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n");
-    
-    write_or_die(fd, buf, strlen(buf));
+//
+// The status code of the response that starts in buf
+//
+int request_status(char *response) {
+    return atoi(response + strlen("HTTP/1.1 "));
+}
+
+//
+// Puts the header that goes in front of what a persistent CGI program sent
+// (out, len bytes) into buf and returns its length, or -1 if out doesn't
+// have the empty line that ends the program's header lines
+//
+int request_format_fcgi_header(char *buf, char *out, size_t len, int keep_alive) {
+    char *end = memmem(out, len, "\r\n\r\n", 4);
+    if (end == NULL)
+	return -1;
+    char *p = buf;
+    p = put_const(p, "HTTP/1.1 200 OK\r\n" SERVER_HEADER);
+    p = put_connection(p, keep_alive);
+    p = put_const(p, "Content-Length: ");
+    p = put_num(p, len - (end + 4 - out));
+    p = put_const(p, "\r\n");
+    return p - buf;
+}
+
+//
+// Has a process from the program's pool answer the request. This thread
+// waits for it, but nothing is forked or executed.
+//
+static void request_serve_fcgi(request_t *req) {
+    char buf[MAXERROR];
+    fcgi_reply_t reply = { 0 };
+    fcgi_proc_t *proc = fcgi_acquire(req->filename, 1);
+    int rc = fcgi_send_request(proc, req->cgiargs);
+    while (rc == 0)
+	rc = fcgi_read_reply(proc, &reply, 0);
+    fcgi_release(proc, rc == 1);
     
-    if (fork_or_die() == 0) {                        // child
-	setenv_or_die("QUERY_STRING", cgiargs, 1);   // args to cgi go here
-	dup2_or_die(fd, STDOUT_FILENO);              // make cgi writes go to socket (not screen)
-	extern char **environ;                       // defined by libc 
-	execve_or_die(filename, argv, environ);
+    int len = rc == 1 ? request_format_fcgi_header(buf, reply.data, reply.len, req->keep_alive) : -1;
+    if (len < 0) {
+	len = request_format_error(buf, req->keep_alive, req->filename, "502", "Bad Gateway", "CGI program failed");
+	req->status = 502;
+	req->bytes = len;
+	send_all(req->fd, buf, len, MSG_NOSIGNAL);
     } else {
-	wait_or_die(NULL);
+	struct iovec iov[2] = { { buf, len }, { reply.data, reply.len } };
+	req->status = 200;
+	req->bytes = len + reply.len;
+	sendv_all(req->fd, iov, 2, MSG_NOSIGNAL);
     }
+    free(reply.data);
 }
 
-void request_serve_static(int fd, char *filename, int filesize) {
-    int srcfd;
-    char *srcp, filetype[MAXBUF], buf[MAXBUF];
-    
-    request_get_filetype(filename, filetype);
-    srcfd = open_or_die(filename, O_RDONLY, 0);
+//
+// The stats page as a whole response, in a new buffer that the caller
+// frees; returns its length
+//
+int request_format_stats(char **out, int keep_alive) {
+    int body_len;
+    char *body = stats_format(&body_len);
+    char *buf = malloc(MAXBUF + body_len), *p = buf;
+    assert(buf != NULL);
+    p = put_const(p, "HTTP/1.1 200 OK\r\n" SERVER_HEADER);
+    p = put_connection(p, keep_alive);
+    p = put_const(p, "Content-Type: text/plain\r\nContent-Length: ");
+    p = put_num(p, body_len);
+    p = put_const(p, "\r\n\r\n");
+    p = put(p, body, body_len);
+    free(body);
+    *out = buf;
+    return p - buf;
+}
+
+//
+// Sends the header (head, len bytes) and then count bytes of the file from
+// offset on, from the disk; returns the length of the response. A file
+// that went away since it was looked up gets an error instead.
+//
+off_t request_serve_static(request_t *req, char *head, int len, off_t offset, off_t count) {
+    if (count == 0) {
+	send_all(req->fd, head, len, MSG_NOSIGNAL);
+	return len;
+    }
+    int srcfd = open(req->filename, O_RDONLY | O_CLOEXEC);
+    if (srcfd < 0) {
+	char buf[MAXERROR];
+	if (errno == ENOENT)
+	    len = request_format_error(buf, req->keep_alive, req->filename, "404", "Not found", "server could not find this file");
+	else
+	    len = request_format_error(buf, req->keep_alive, req->filename, "403", "Forbidden", "server could not read this file");
+	stats_count(STAT_ERRORS);
+	req->status = request_status(buf);
+	send_all(req->fd, buf, len, MSG_NOSIGNAL);
+	return len;
+    }
     
-    // Rather than call read() to read the file into memory, 
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = mmap_or_die(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    // MSG_MORE holds the header back so it leaves in the same packet as the
+    // start of the file instead of in a small one of its own
+    if (send_all(req->fd, head, len, MSG_MORE | MSG_NOSIGNAL) == len) {
+	// Rather than read() the file into memory and write it back out,
+	// sendfile() has the kernel copy it straight from the page cache.
+	// If the client has gone there is nobody left to tell, so just stop.
+	sendfile_all(req->fd, srcfd, offset, count);
+    }
     close_or_die(srcfd);
-    
-    // put together response
-    sprintf(buf, ""
-	    "HTTP/1.0 200 OK\r\n"
-	    "Server: OSTEP WebServer\r\n"
-	    "Content-Length: %d\r\n"
-	    "Content-Type: %s\r\n\r\n", 
-	    filesize, filetype);
-    
-    write_or_die(fd, buf, strlen(buf));
-    
-    //  Writes out to the client socket the memory-mapped file 
-    write_or_die(fd, srcp, filesize);
-    munmap_or_die(srcp, filesize);
+    return len + count;
 }
 
-// handle a request
-void request_handle(int fd) {
-    int is_static;
-    struct stat sbuf;
-    char buf[MAXBUF], method[MAXBUF], uri[MAXBUF], version[MAXBUF];
-    char filename[MAXBUF], cgiargs[MAXBUF];
-    
-    readline_or_die(fd, buf, MAXBUF);
-    sscanf(buf, "%s %s %s", method, uri, version);
-    printf("method:%s uri:%s version:%s\n", method, uri, version);
+//
+// Compresses len bytes of data into a new gzip buffer; returns it and sets
+// *out_len to its length. It is done once per file, so for the smallest result.
+//
+static char *request_gzip(char *data, size_t len, size_t *out_len) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    // 16 over the usual window bits asks for a gzip wrapper
+    assert(deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+    size_t bound = deflateBound(&z, len);
+    char *out = malloc(bound);
+    assert(out != NULL);
+    z.next_in = (Bytef *) data;
+    z.avail_in = len;
+    z.next_out = (Bytef *) out;
+    z.avail_out = bound;
+    assert(deflate(&z, Z_FINISH) == Z_STREAM_END);
+    *out_len = z.total_out;
+    deflateEnd(&z);
+    return out;
+}
+
+//
+// The key req's response is cached under (MAXCACHEKEY bytes): its file's
+// path, with "gzip:" in front when it is sent encoded, as a .gz sibling
+// sent in place of its file and the same .gz asked for by name need other
+// headers. Filenames all start with '.', so none looks like that. The file
+// compressed goes where its .gz sibling would, still checked against the
+// file's own stat, so it gives way to a real sibling that turns up later.
+//
+#define MAXCACHEKEY (MAXBUF + 16)
+
+static void request_cache_path(request_t *req, char *path) {
+    sprintf(path, "%s%s%s", req->gzip ? "gzip:" : "", req->filename, req->compress ? ".gz" : "");
+}
+
+//
+// The cache entry for what req is to be sent, if there is one; it has to be released
+//
+cache_entry_t *request_cache_find(request_t *req) {
+    char path[MAXCACHEKEY];
+    request_cache_path(req, path);
+    return cache_find(path, &req->sbuf);
+}
+
+//
+// Reads all of the open file fd into a new buffer; NULL if it is gone or
+// got shorter since the stat
+//
+static char *request_read_file(int fd, off_t filesize) {
+    char *data = malloc(filesize + 1);
+    assert(data != NULL);
+    for (off_t got = 0; got < filesize; ) {
+	ssize_t rc = pread(fd, data + got, filesize - got, got);
+	if (rc < 0 && errno == EINTR)
+	    continue;
+	if (rc <= 0) {
+	    free(data);
+	    return NULL;
+	}
+	got += rc;
+    }
+    return data;
+}
+
+//
+// Reads the open file fd, which req is for, into a new cache entry along
+// with its response headers, compressing it first if req says so, and
+// adds it to the cache. Returns the entry, which the caller has to
+// release, or NULL if the file couldn't be read.
+//
+cache_entry_t *request_cache_load(request_t *req, int fd) {
+    char keep_head[MAXBUF], close_head[MAXBUF], path[MAXCACHEKEY];
+    size_t body_len = req->sbuf.st_size;
+    char *body = request_read_file(fd, body_len);
+    if (body == NULL)
+	return NULL;
+    if (req->compress) {
+	char *gz = request_gzip(body, body_len, &body_len);
+	free(body);
+	body = gz;
+    }
+    int keep_len = request_format_static_header(keep_head, req, body_len, 1);
+    int close_len = request_format_static_header(close_head, req, body_len, 0);
     
-    if (strcasecmp(method, "GET")) {
-	request_error(fd, method, "501", "Not Implemented", "server does not implement this method");
+    cache_entry_t *entry = malloc(sizeof(cache_entry_t));
+    assert(entry != NULL);
+    request_cache_path(req, path);
+    entry->size = keep_len + body_len + close_len;
+    entry->data = malloc(entry->size);
+    entry->path = strdup(path);
+    assert(entry->data != NULL && entry->path != NULL);
+    entry->sbuf = req->sbuf;
+    entry->head_len = keep_len;
+    entry->close_len = close_len;
+    entry->refs = 1;
+    memcpy(entry->data, keep_head, keep_len);
+    memcpy(entry->data + keep_len, body, body_len);
+    memcpy(entry->data + keep_len + body_len, close_head, close_len);
+    free(body);
+    cache_add(entry);
+    return entry;
+}
+
+//
+// Sends a cached file, header and file together in one sendmsg() when the
+// socket takes it all. With keep-alive they are already one block.
+// Returns the length of the response.
+//
+static off_t request_serve_cached(int fd, cache_entry_t *entry, int keep_alive) {
+    size_t filesize = entry->size - entry->head_len - entry->close_len;
+    struct iovec iov[2];
+    int n = 0;
+    if (keep_alive) {
+	iov[n].iov_base = entry->data;
+	iov[n++].iov_len = entry->head_len + filesize;
+    } else {
+	iov[n].iov_base = entry->data + entry->size - entry->close_len;
+	iov[n++].iov_len = entry->close_len;
+	iov[n].iov_base = entry->data + entry->head_len;
+	iov[n++].iov_len = filesize;
+    }
+    off_t len = keep_alive ? entry->head_len + filesize : entry->close_len + filesize;
+    sendv_all(fd, iov, n, MSG_NOSIGNAL);
+    return len;
+}
+
+//
+// Serves a static file from the cache, putting it there first if it isn't
+// and it fits; files that don't are sent from the disk. So are ranges,
+// which are mostly asked for to resume downloads too big to cache.
+//
+static void request_serve_file(request_t *req) {
+    char buf[MAXBUF];
+    off_t offset, count;
+    stats_count(STAT_STATIC);
+    int len = request_format_partial(buf, req, &offset, &count);
+    if (len > 0) {
+	req->status = request_status(buf);
+	req->bytes = request_serve_static(req, buf, len, offset, count);
 	return;
     }
-    request_read_headers(fd);
     
-    is_static = request_parse_uri(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0) {
-	request_error(fd, filename, "404", "Not found", "server could not find this file");
+    cache_entry_t *entry = request_cache_find(req);
+    if (entry != NULL)
+	stats_count(STAT_CACHE_HITS);
+    if (entry == NULL && cache_fits(req->sbuf.st_size)) {
+	int fd = open(req->filename, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+	    entry = request_cache_load(req, fd);
+	    close_or_die(fd);
+	}
+    }
+    req->status = 200;
+    if (entry != NULL) {
+	req->bytes = request_serve_cached(req->fd, entry, req->keep_alive);
+	cache_release(entry);
+    } else {
+	// only the cache has a compressed copy, but a .gz sibling on disk is
+	// already compressed and keeps its encoding
+	if (req->compress)
+	    req->gzip = req->compress = 0;
+	len = request_format_static_header(buf, req, req->sbuf.st_size, req->keep_alive);
+	req->bytes = request_serve_static(req, buf, len, 0, req->sbuf.st_size);
+    }
+}
+
+//
+// Works out what the tokenized request asks for
+//
+static void request_lookup(request_t *req) {
+    req->size = 0;
+    req->found = 0;
+    req->is_get = !strcasecmp(req->method, "GET");
+    if (!req->is_get) {
+	// there may be a body we don't know how to skip
+	req->keep_alive = 0;
 	return;
     }
+    route_t route = request_parse_uri(req);
+    req->is_stats = route == ROUTE_STATS;
+    if (req->is_stats) {
+	req->found = 1;
+	return;
+    }
+    req->is_static = route == ROUTE_STATIC;
+    if (!req->is_static && !fcgi_is_program(req->filename))
+	req->keep_alive = 0;
+    req->found = stat(req->filename, &req->sbuf) == 0;
+    if (req->found) {
+	req->size = req->sbuf.st_size;
+	if (req->is_static && req->accept_gzip && S_ISREG(req->sbuf.st_mode))
+	    request_choose_encoding(req);
+    }
+}
+
+//
+// A request on fd (read through rio, if it isn't NULL) with nothing in it yet
+//
+request_t *request_new(int fd, rio_t *rio) {
+    request_t *req = malloc(sizeof(request_t));
+    assert(req != NULL);
+    req->fd = fd;
+    req->rio = rio;
+    req->method = NULL;
+    req->is_stats = 0;
+    req->range = req->if_range = req->if_none_match = req->if_modified_since = NULL;
+    req->accept_gzip = req->gzip = req->compress = 0;
+    req->status = 0;
+    req->bytes = -1;
+    return req;
+}
+
+//
+// Works out what the request in buf (len bytes: the request line and
+// headers, up to and including the empty line) asks for
+//
+request_t *request_parse(int fd, char *buf, int len) {
+    request_t *req = request_new(fd, NULL);
+    if (len > MAXBUF - 1)
+	len = MAXBUF - 1;
+    memcpy(req->head, buf, len);
+    req->head[len] = '\0';
+    req->t_read = stats_now();
+    request_tokenize(req);
+    request_lookup(req);
+    stats_time(STAT_PARSE, stats_now() - req->t_read);
+    return req;
+}
+
+//
+// Reads the request line and headers into req from its connection and works
+// out what they ask for. Headers that don't fit in MAXBUF are read and dropped.
+//
+void request_fill(request_t *req) {
+    rio_t *rio = req->rio;
+    char discard[MAXBUF];
+    int len = 0;
+    int at_line_start = 1; // a long line can take more than one read
+    int failed = 0;
     
-    if (is_static) {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not read this file");
-	    return;
+    while (1) {
+	char *line = MAXBUF - len > 2 ? req->head + len : discard;
+	ssize_t n = rio_readline(rio, line, line == discard ? MAXBUF : MAXBUF - len);
+	// a connection reset (or timed out) by the client is as good as closed
+	if (n < 0)
+	    failed = 1;
+	if (n <= 0)
+	    break;
+	int blank = at_line_start && (!strcmp(line, "\r\n") || !strcmp(line, "\n"));
+	at_line_start = line[n - 1] == '\n';
+	if (blank && len == 0)
+	    continue; // empty lines before the request line are ignored
+	if (blank)
+	    break;
+	if (line != discard)
+	    len += n;
+    }
+    req->head[len] = '\0';
+    req->t_read = stats_now();
+    request_tokenize(req);
+    request_lookup(req);
+    if (failed)
+	req->keep_alive = 0;
+    stats_time(STAT_PARSE, stats_now() - req->t_read);
+}
+
+request_t *request_read(rio_t *rio) {
+    request_t *req = request_new(rio->fd, rio);
+    request_fill(req);
+    return req;
+}
+
+//
+// If the request can't be served, puts the error response for it into buf
+// (which must hold MAXERROR bytes) and returns its length; returns 0 otherwise
+//
+int request_check(request_t *req, char *buf) {
+    if (req->is_stats)
+	return 0;
+    if (!req->is_get) {
+	return request_format_error(buf, req->keep_alive, req->method, "501", "Not Implemented", "server does not implement this method");
+    } else if (!req->found) {
+	return request_format_error(buf, req->keep_alive, req->filename, "404", "Not found", "server could not find this file");
+    } else if (req->is_static) {
+	if (!(S_ISREG(req->sbuf.st_mode)) || !(S_IRUSR & req->sbuf.st_mode)) {
+	    return request_format_error(buf, req->keep_alive, req->filename, "403", "Forbidden", "server could not read this file");
 	}
-	request_serve_static(fd, filename, sbuf.st_size);
     } else {
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) {
-	    request_error(fd, filename, "403", "Forbidden", "server could not run this CGI program");
-	    return;
+	if (!(S_ISREG(req->sbuf.st_mode)) || !(S_IXUSR & req->sbuf.st_mode)) {
+	    return request_format_error(buf, req->keep_alive, req->filename, "403", "Forbidden", "server could not run this CGI program");
 	}
-	request_serve_dynamic(fd, filename, cgiargs);
     }
+    return 0;
+}
+
+//
+// Sends the response to a request that has been read, then frees it
+//
+void request_serve(request_t *req) {
+    char buf[MAXERROR];
+    long start = stats_now();
+    int len = request_check(req, buf);
+    
+    stats_count(STAT_REQUESTS);
+    if (len > 0) {
+	stats_count(STAT_ERRORS);
+	req->status = request_status(buf);
+	req->bytes = len;
+	send_all(req->fd, buf, len, MSG_NOSIGNAL);
+    } else if (req->is_stats) {
+	char *page;
+	len = request_format_stats(&page, req->keep_alive);
+	req->status = 200;
+	req->bytes = len;
+	send_all(req->fd, page, len, MSG_NOSIGNAL);
+	free(page);
+    } else if (req->is_static) {
+	request_serve_file(req);
+    } else if (fcgi_is_program(req->filename)) {
+	stats_count(STAT_FCGI);
+	request_serve_fcgi(req);
+    } else {
+	stats_count(STAT_CGI);
+	req->status = 200; // the program writes the rest
+	request_serve_dynamic(req->fd, req->filename, req->cgiargs);
+    }
+    request_done(req, start);
+}
+
+//
+// Records a request whose response, started at start, has been sent, and frees it
+//
+void request_done(request_t *req, long start) {
+    long us = stats_now() - start;
+    stats_time(STAT_SERVICE, us);
+    log_request(req, us);
+    free(req);
+}
+
+//
+// Waits for the next request on a kept-alive connection; returns 1 if one
+// starts arriving within the idle timeout, 0 if the client closed or went quiet
+//
+int request_wait(rio_t *rio) {
+    struct pollfd pfd = { .fd = rio->fd, .events = POLLIN };
+    char c;
+    if (rio->count > 0)
+	return 1; // pipelined
+    if (poll(&pfd, 1, request_idle_timeout * 1000) <= 0)
+	return 0;
+    return recv(rio->fd, &c, 1, MSG_PEEK) == 1;
+}
+
+//
+// Serves req and then, while the connection is kept alive, the requests
+// that follow it on the same connection (pipelined or not). Leaves fd open.
+// Without a reader for the connection, only req is served.
+//
+void request_serve_connection(request_t *req) {
+    rio_t *rio = req->rio;
+    for (int served = 1; ; served++) {
+	if (served >= request_max_per_conn || rio == NULL)
+	    req->keep_alive = 0;
+	int keep_alive = req->keep_alive;
+	request_serve(req);
+	if (!keep_alive || !request_wait(rio))
+	    return;
+	req = request_read(rio);
+    }
+}
+
+// handle a request
+void request_handle(int fd) {
+    rio_t rio;
+    rio_init(&rio, fd);
+    request_serve(request_read(&rio));
 }
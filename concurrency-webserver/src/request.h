@@ -1,5 +1,67 @@
 #ifndef __REQUEST_H__
+#define __REQUEST_H__
 
+#include <sys/stat.h>
+#include "io_helper.h"
+#include "cache.h"
+#include "fcgi.h"
+#include "stats.h"
+
+#define MAXBUF (8192)
+#define MAXERROR (2 * MAXBUF) // an error response, header and body
+
+//
+// A request whose line and headers have been read, ready to be served.
+// Reading it also finds the file it is for, so it can be scheduled by size.
+//
+typedef struct {
+    int fd;
+    rio_t *rio;                  // reader for the connection, NULL if it isn't read again
+    int is_get;                  // 0 if the method isn't supported
+    int is_static;
+    int is_stats;                // 1 for the stats page
+    int found;                   // 0 if stat failed on filename
+    int keep_alive;              // 1 if the connection stays open after the response
+    char *range;                 // values of the headers for partial and conditional
+    char *if_range;              // requests (in head), NULL if not sent
+    char *if_none_match;
+    char *if_modified_since;
+    int accept_gzip;             // 1 if the client takes gzip encoding
+    int gzip;                    // 1 if the file is sent gzip encoded: filename is
+    int compress;                // its .gz sibling, or, with compress, it is compressed into the cache
+    struct stat sbuf;
+    off_t size;                  // of the file or CGI program, 0 if none
+    long t_read;                 // stats_now() when the headers were in
+    long t_queued;               // and when it was put in the buffer
+    int status;                  // of the response, for the access log
+    off_t bytes;                 // in the response, -1 if not known (CGI)
+    char head[MAXBUF];           // the request line and headers, split up in place
+    char *method, *uri, *version; // method is NULL until the request is read
+    char filename[MAXBUF], cgiargs[MAXBUF];
+} request_t;
+
+extern int request_max_per_conn;
+extern int request_idle_timeout;
+extern int request_max_cgi;
+extern int request_compress;
+
+int request_format_error(char *buf, int keep_alive, char *cause, char *errnum, char *shortmsg, char *longmsg);
+int request_format_static_header(char *buf, request_t *req, off_t len, int keep_alive);
+int request_format_partial(char *buf, request_t *req, off_t *offset, off_t *count);
+int request_status(char *response);
+int request_format_fcgi_header(char *buf, char *out, size_t len, int keep_alive);
+int request_format_stats(char **out, int keep_alive);
+cache_entry_t *request_cache_find(request_t *req);
+cache_entry_t *request_cache_load(request_t *req, int fd);
+request_t *request_parse(int fd, char *buf, int len);
+request_t *request_new(int fd, rio_t *rio);
+void request_fill(request_t *req);
+request_t *request_read(rio_t *rio);
+int request_check(request_t *req, char *buf);
+void request_serve(request_t *req);
+void request_done(request_t *req, long start);
+int request_wait(rio_t *rio);
+void request_serve_connection(request_t *req);
 void request_handle(int fd);
 
 #endif // __REQUEST_H__
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -21,11 +23,12 @@ double get_seconds() {
 }
 
 
-int main(int argc, char *argv[]) {
-    // Extract arguments
+//
+// Spins for as many seconds as the query says, then makes the response body
+//
+void spin(char *buf, char *content) {
     double spin_for = 0.0;
-    char *buf;
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
+    if (buf != NULL) {
 	// just expecting a single number
 	spin_for = (double) atoi(buf);
     }
@@ -36,10 +39,61 @@ int main(int argc, char *argv[]) {
     double t2 = get_seconds();
     
     /* Make the response body */
-    char content[MAXBUF];
     sprintf(content, "<p>Welcome to the CGI program (%s)</p>\r\n", buf);
     sprintf(content, "%s<p>My only purpose is to waste time on the server!</p>\r\n", content);
     sprintf(content, "%s<p>I spun for %.2f seconds</p>\r\n", content, t2 - t1);
+}
+
+// read or write all len bytes; returns 0 if the socket closes or fails
+int read_all(int fd, void *buf, size_t len) {
+    for (size_t got = 0; got < len; ) {
+	ssize_t rc = read(fd, (char *) buf + got, len - got);
+	if (rc <= 0)
+	    return 0;
+	got += rc;
+    }
+    return 1;
+}
+
+int write_all(int fd, void *buf, size_t len) {
+    for (size_t sent = 0; sent < len; ) {
+	ssize_t rc = write(fd, (char *) buf + sent, len - sent);
+	if (rc <= 0)
+	    return 0;
+	sent += rc;
+    }
+    return 1;
+}
+
+//
+// Run by the server as a persistent program (named spin.fcgi), stdin is a
+// socket: answer requests from it until the server closes it. Each is a
+// 4-byte length and the query string; each reply a 4-byte length and
+// the header lines and body, without Content-Length, which the server adds.
+//
+void serve_persistent() {
+    char query[MAXBUF], content[MAXBUF], reply[2 * MAXBUF];
+    uint32_t len;
+    while (read_all(STDIN_FILENO, &len, sizeof(len)) && len < MAXBUF && read_all(STDIN_FILENO, query, len)) {
+	query[len] = '\0';
+	spin(query, content);
+	len = sprintf(reply, "Content-Type: text/html\r\n\r\n%s", content);
+	if (!write_all(STDIN_FILENO, &len, sizeof(len)) || !write_all(STDIN_FILENO, reply, len))
+	    break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct stat sbuf;
+    if (fstat(STDIN_FILENO, &sbuf) == 0 && S_ISSOCK(sbuf.st_mode)) {
+	serve_persistent();
+	exit(0);
+    }
+    
+    // Extract arguments
+    char content[MAXBUF];
+    char *buf = getenv("QUERY_STRING");
+    spin(buf, content);
     
     /* Generate the HTTP response */
     printf("Content-Length: %lu\r\n", strlen(content));
@@ -49,4 +103,3 @@ int main(int argc, char *argv[]) {
     
     exit(0);
 }
-
@@ -0,0 +1,122 @@
+#include "io_helper.h"
+#include "stats.h"
+
+//
+// A thread's stats are made the first time it counts something and are
+// never freed. Only the thread itself writes them; a reader adding them up
+// may be a request or two behind, which is fine for what they are for.
+//
+
+static __thread stats_t *mine;
+static stats_t *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static long start_us;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "connections", "requests", "static", "cache hits", "cgi", "fcgi", "errors", "handed off",
+    "log dropped"
+};
+static const char *time_names[STAT_TIMES] = {
+    "accept wait", "queue wait", "parse", "service"
+};
+
+//
+// Microseconds on a clock that only goes forwards
+//
+long stats_now(void) {
+    struct timespec t;
+    assert(clock_gettime(CLOCK_MONOTONIC, &t) == 0);
+    return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+static stats_t *stats_mine(void) {
+    if (mine == NULL) {
+	mine = calloc(1, sizeof(stats_t));
+	assert(mine != NULL);
+	pthread_mutex_lock_or_die(&stats_lock);
+	mine->next = all_stats;
+	all_stats = mine;
+	pthread_mutex_unlock_or_die(&stats_lock);
+    }
+    return mine;
+}
+
+void stats_count(stat_counter_t counter) {
+    stats_mine()->counters[counter]++;
+}
+
+void stats_time(stat_time_t time, long us) {
+    hist_add(&stats_mine()->times[time], us);
+}
+
+//
+// Adds up every thread's stats into a text page, returned in a new buffer
+// (which the caller frees), and sets *len to its length
+//
+char *stats_format(int *len) {
+    long counters[STAT_COUNTERS] = { 0 };
+    hist_t *times = calloc(STAT_TIMES, sizeof(hist_t));
+    int threads = 0;
+    assert(times != NULL);
+    pthread_mutex_lock_or_die(&stats_lock);
+    for (stats_t *s = all_stats; s != NULL; s = s->next) {
+	for (int i = 0; i < STAT_COUNTERS; i++)
+	    counters[i] += s->counters[i];
+	for (int i = 0; i < STAT_TIMES; i++)
+	    hist_merge(&times[i], &s->times[i]);
+	threads++;
+    }
+    pthread_mutex_unlock_or_die(&stats_lock);
+
+    int size = 1024 + 128 * (STAT_COUNTERS + STAT_TIMES);
+    char *page = malloc(size), *p = page;
+    assert(page != NULL);
+    double up = (stats_now() - start_us) / 1e6;
+    p += sprintf(p, "uptime: %.1f s  threads: %d  requests/s: %.1f\n\n", up, threads,
+		 up > 0 ? counters[STAT_REQUESTS] / up : 0);
+    for (int i = 0; i < STAT_COUNTERS; i++)
+	p += sprintf(p, "%-12s %ld\n", counter_names[i], counters[i]);
+    p += sprintf(p, "\n%-12s %10s %9s %9s %9s %9s %9s %9s  (ms)\n",
+		 "", "count", "mean", "p50", "p90", "p99", "p999", "max");
+    for (int i = 0; i < STAT_TIMES; i++) {
+	hist_t *h = &times[i];
+	p += sprintf(p, "%-12s %10ld %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", time_names[i], h->count,
+		     h->count > 0 ? h->sum / h->count / 1e3 : 0, hist_percentile(h, 0.5) / 1e3,
+		     hist_percentile(h, 0.9) / 1e3, hist_percentile(h, 0.99) / 1e3,
+		     hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+    free(times);
+    *len = p - page;
+    return page;
+}
+
+//
+// SIGUSR1 is blocked in every thread and taken by this one with sigwait(),
+// so the stats are written to stderr by an ordinary thread rather than
+// from a signal handler
+//
+static void *stats_dumper(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0) {
+	int len;
+	char *page = stats_format(&len);
+	fwrite(page, 1, len, stderr);
+	fflush(stderr);
+	free(page);
+    }
+    return NULL;
+}
+
+//
+// Called before any other thread is started, so they all inherit the blocked signal
+//
+void stats_start_dumper(void) {
+    static sigset_t set;
+    pthread_t thread;
+    start_us = stats_now();
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    assert(pthread_sigmask(SIG_BLOCK, &set, NULL) == 0);
+    pthread_create_or_die(&thread, NULL, stats_dumper, &set);
+}
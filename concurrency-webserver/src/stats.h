@@ -0,0 +1,40 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "hist.h"
+
+//
+// Counters and latency histograms. Every thread has its own, so counting
+// takes no lock; they are only added up when someone asks for them, at
+// /__stats or with SIGUSR1.
+//
+// The times are:
+//   accept wait: from accepting a connection until its first request is in
+//   queue wait:  in the buffer between the master (or an event loop) and a worker
+//   parse:       tokenizing the request and finding its file
+//   service:     from starting on the response until it has all been sent
+//
+typedef enum {
+    STAT_CONNECTIONS, STAT_REQUESTS, STAT_STATIC, STAT_CACHE_HITS,
+    STAT_CGI, STAT_FCGI, STAT_ERRORS, STAT_HANDOFFS, STAT_LOG_DROPPED, STAT_COUNTERS
+} stat_counter_t;
+
+typedef enum {
+    STAT_ACCEPT_WAIT, STAT_QUEUE_WAIT, STAT_PARSE, STAT_SERVICE, STAT_TIMES
+} stat_time_t;
+
+typedef struct stats {
+    long counters[STAT_COUNTERS];
+    hist_t times[STAT_TIMES];
+    struct stats *next;          // in the list of all threads' stats
+} stats_t;
+
+#define STATS_URI "/__stats"
+
+long stats_now(void);
+void stats_count(stat_counter_t counter);
+void stats_time(stat_time_t time, long us);
+char *stats_format(int *len);
+void stats_start_dumper(void);
+
+#endif // __STATS_H__
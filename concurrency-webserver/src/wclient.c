@@ -1,25 +1,32 @@
 //
-// client.c: A very, very primitive HTTP client.
+// wclient.c: A very, very primitive HTTP client.
 // 
 // To run, try: 
-//      client hostname portnumber filename
+//      wclient hostname portnumber filename
 //
 // Sends one HTTP request to the specified HTTP server.
 // Prints out the HTTP response.
 //
-// For testing your server, you will want to modify this client.  
-// For example:
-// You may want to make this multi-threaded so that you can 
-// send many requests simultaneously to the server.
+// With options, it is a load generator instead:
+//      wclient [-t threads] [-n requests | -d seconds] [-r rate] [-k]
+//              hostname portnumber filename
+//      wclient [-t threads] [-n requests | -d seconds] [-r rate] [-k]
+//              -f urifile hostname portnumber
 //
-// You may also want to be able to request different URIs; 
-// you may want to get more URIs from the command line 
-// or read the list from a file. 
-//
-// When we test your server, we will be using modifications to this client.
+// Each of the threads sends one request at a time, so -t is the number
+// of requests in flight. With -r, the threads instead start requests on a
+// schedule adding up to rate per second, and a request's latency counts
+// from when it was due, so a slow server can't hide behind a stalled
+// client. -k keeps connections open between requests. Every request is
+// for filename, or, with -f, for the URIs read from urifile (one per
+// line) in turn.
+// It stops after -n requests in all or -d seconds (10 if neither is given)
+// and prints the throughput and latency percentiles.
 //
 
+#define _GNU_SOURCE // for strcasestr
 #include "io_helper.h"
+#include "hist.h"
 
 #define MAXBUF (8192)
 
@@ -33,9 +40,13 @@ void client_send(int fd, char *filename) {
     gethostname_or_die(hostname, MAXBUF);
     
     /* Form and send the HTTP request */
-    sprintf(buf, "GET %s HTTP/1.1\n", filename);
-    sprintf(buf, "%shost: %s\n\r\n", buf, hostname);
-    write_or_die(fd, buf, strlen(buf));
+    // we read the response until EOF
+    int len = snprintf(buf, MAXBUF, "GET %s HTTP/1.1\nhost: %s\nConnection: close\n\r\n", filename, hostname);
+    if (len >= MAXBUF) {
+	fprintf(stderr, "wclient: filename too long\n");
+	exit(1);
+    }
+    write_or_die(fd, buf, len);
 }
 
 //
@@ -44,12 +55,15 @@ void client_send(int fd, char *filename) {
 void client_print(int fd) {
     char buf[MAXBUF];  
     int n;
+    rio_t rio;
+    
+    rio_init(&rio, fd);
     
     // Read and display the HTTP Header 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_readline_or_die(&rio, buf, MAXBUF);
     while (strcmp(buf, "\r\n") && (n > 0)) {
 	printf("Header: %s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	n = rio_readline_or_die(&rio, buf, MAXBUF);
 	
 	// If you want to look for certain HTTP tags... 
 	// int length = 0;
@@ -59,26 +73,261 @@ void client_print(int fd) {
     }
     
     // Read and display the HTTP Body 
-    n = readline_or_die(fd, buf, MAXBUF);
+    n = rio_read_or_die(&rio, buf, MAXBUF);
     while (n > 0) {
-	printf("%s", buf);
-	n = readline_or_die(fd, buf, MAXBUF);
+	fwrite(buf, 1, n, stdout);
+	n = rio_read_or_die(&rio, buf, MAXBUF);
+    }
+}
+
+//
+// The load generator
+//
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    int fd;                      // kept-alive connection, or -1
+    rio_t rio;
+    long requests;               // done
+    long errors;                 // connection failed or closed early
+    long bad_status;             // answered, but not with 2xx or 3xx
+    long bytes;                  // of response bodies
+    hist_t latency;
+} load_thread_t;
+
+static struct sockaddr_in server_addr;
+static char hostname[MAXBUF];
+static char **uris;
+static int num_uris;
+static int threads = 1;
+static long max_requests;        // 0 if running for a time
+static double seconds = 10;
+static double rate;              // requests per second, 0 for as fast as answered
+static int keep_alive;
+static double start_time;
+
+double get_seconds() {
+    struct timespec t;
+    assert(clock_gettime(CLOCK_MONOTONIC, &t) == 0);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//
+// Reads the response to one request, throwing the body away. Returns its
+// status, or -1 if the connection failed. Sets *reusable if the
+// connection may be used for another request.
+//
+int load_read_response(load_thread_t *lt, int *reusable) {
+    char buf[MAXBUF];
+    int status = -1;
+    long length = -1;
+    int server_close = 0;
+    
+    if (rio_readline(&lt->rio, buf, MAXBUF) <= 0 || sscanf(buf, "HTTP/%*s %d", &status) != 1)
+	return -1;
+    while (1) {
+	if (rio_readline(&lt->rio, buf, MAXBUF) <= 0)
+	    return -1;
+	if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+	    break;
+	if (!strncasecmp(buf, "Content-Length:", 15))
+	    length = atol(buf + 15);
+	else if (!strncasecmp(buf, "Connection:", 11) && strcasestr(buf + 11, "close") != NULL)
+	    server_close = 1;
+    }
+    // without a length, the body ends when the server closes
+    long got = 0;
+    while (length < 0 || got < length) {
+	size_t want = length < 0 || length - got > MAXBUF ? MAXBUF : length - got;
+	ssize_t n = rio_read(&lt->rio, buf, want);
+	if (n < 0 || (n == 0 && length >= 0))
+	    return -1;
+	if (n == 0)
+	    break;
+	got += n;
+    }
+    lt->bytes += got;
+    *reusable = keep_alive && !server_close && length >= 0;
+    return status;
+}
+
+//
+// Sends one request, on the kept-alive connection if there is one, and
+// reads the response. Returns its status, or -1.
+//
+int load_request(load_thread_t *lt, char *uri) {
+    char buf[MAXBUF];
+    if (lt->fd < 0) {
+	lt->fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lt->fd < 0)
+	    return -1;
+	if (connect(lt->fd, (sockaddr_t *) &server_addr, sizeof(server_addr)) < 0) {
+	    close_or_die(lt->fd);
+	    lt->fd = -1;
+	    return -1;
+	}
+	rio_init(&lt->rio, lt->fd);
+    }
+    int len = snprintf(buf, MAXBUF, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+		       uri, hostname, keep_alive ? "keep-alive" : "close");
+    int reusable = 0;
+    int status = -1;
+    if (send_all(lt->fd, buf, len, MSG_NOSIGNAL) == len)
+	status = load_read_response(lt, &reusable);
+    if (!reusable) {
+	close_or_die(lt->fd);
+	lt->fd = -1;
+    }
+    return status;
+}
+
+void *load_thread(void *arg) {
+    load_thread_t *lt = arg;
+    // with a rate, each thread's requests are due at even intervals,
+    // and the threads are staggered across one interval
+    double interval = rate > 0 ? threads / rate : 0;
+    double due = start_time + interval * lt->id / threads;
+    long quota = max_requests / threads + (lt->id < max_requests % threads);
+    
+    for (int i = lt->id; ; i++) {
+	if (max_requests > 0 ? lt->requests >= quota : get_seconds() - start_time >= seconds)
+	    break;
+	if (interval > 0) {
+	    double wait = due - get_seconds();
+	    if (wait > 0)
+		usleep(wait * 1e6);
+	} else {
+	    due = get_seconds();
+	}
+	int status = load_request(lt, uris[i % num_uris]);
+	hist_add(&lt->latency, (get_seconds() - due) * 1e6);
+	lt->requests++;
+	if (status < 0)
+	    lt->errors++;
+	else if (status < 200 || status >= 400)
+	    lt->bad_status++;
+	due += interval;
+    }
+    if (lt->fd >= 0)
+	close_or_die(lt->fd);
+    return NULL;
+}
+
+//
+// Reads the URIs, one per line, from filename
+//
+void load_read_uris(char *filename) {
+    char line[MAXBUF];
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+	fprintf(stderr, "wclient: cannot open %s\n", filename);
+	exit(1);
     }
+    while (fgets(line, MAXBUF, f) != NULL) {
+	line[strcspn(line, "\r\n")] = '\0';
+	if (line[0] == '\0')
+	    continue;
+	uris = realloc(uris, (num_uris + 1) * sizeof(char *));
+	assert(uris != NULL);
+	uris[num_uris] = strdup(line);
+	assert(uris[num_uris] != NULL);
+	num_uris++;
+    }
+    fclose(f);
+}
+
+void load_run(char *host, int port) {
+    struct hostent *hp = gethostbyname_or_die(host);
+    bzero((char *) &server_addr, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    bcopy((char *) hp->h_addr, (char *) &server_addr.sin_addr.s_addr, hp->h_length);
+    server_addr.sin_port = htons(port);
+    gethostname_or_die(hostname, MAXBUF);
+    
+    load_thread_t *lts = calloc(threads, sizeof(load_thread_t));
+    assert(lts != NULL);
+    start_time = get_seconds();
+    for (int i = 0; i < threads; i++) {
+	lts[i].id = i;
+	lts[i].fd = -1;
+	hist_init(&lts[i].latency);
+	pthread_create_or_die(&lts[i].thread, NULL, load_thread, &lts[i]);
+    }
+    
+    hist_t all;
+    hist_init(&all);
+    long requests = 0, errors = 0, bad_status = 0, bytes = 0;
+    for (int i = 0; i < threads; i++) {
+	assert(pthread_join(lts[i].thread, NULL) == 0);
+	requests += lts[i].requests;
+	errors += lts[i].errors;
+	bad_status += lts[i].bad_status;
+	bytes += lts[i].bytes;
+	hist_merge(&all, &lts[i].latency);
+    }
+    double elapsed = get_seconds() - start_time;
+    
+    printf("requests: %ld  errors: %ld  non-2xx/3xx: %ld  seconds: %.2f\n", requests, errors, bad_status, elapsed);
+    printf("throughput: %.1f requests/s  %.2f MB/s\n", requests / elapsed, bytes / elapsed / (1 << 20));
+    if (all.count > 0)
+	printf("latency (ms): mean %.3f  p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+	       all.sum / all.count / 1e3, hist_percentile(&all, 0.5) / 1e3, hist_percentile(&all, 0.9) / 1e3,
+	       hist_percentile(&all, 0.99) / 1e3, hist_percentile(&all, 0.999) / 1e3, all.max / 1e3);
+    free(lts);
 }
 
 int main(int argc, char *argv[]) {
     char *host, *filename;
     int port;
     int clientfd;
+    int c, load = 0;
     
-    if (argc != 4) {
+    while ((c = getopt(argc, argv, "t:n:d:r:kf:")) != -1) {
+	load = 1;
+	switch (c) {
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'n':
+	    max_requests = atol(optarg);
+	    break;
+	case 'd':
+	    seconds = atof(optarg);
+	    break;
+	case 'r':
+	    rate = atof(optarg);
+	    break;
+	case 'k':
+	    keep_alive = 1;
+	    break;
+	case 'f':
+	    load_read_uris(optarg);
+	    break;
+	default:
+	    load = -1;
+	}
+    }
+    // the URIs come from -f or filename, not both
+    if (load < 0 || threads <= 0 || argc - optind != (num_uris > 0 ? 2 : 3)) {
 	fprintf(stderr, "Usage: %s <host> <port> <filename>\n", argv[0]);
+	fprintf(stderr, "       %s [-t threads] [-n requests | -d seconds] [-r rate] [-k] <host> <port> <filename>\n", argv[0]);
+	fprintf(stderr, "       %s [-t threads] [-n requests | -d seconds] [-r rate] [-k] -f urifile <host> <port>\n", argv[0]);
 	exit(1);
     }
     
-    host = argv[1];
-    port = atoi(argv[2]);
-    filename = argv[3];
+    host = argv[optind];
+    port = atoi(argv[optind + 1]);
+    filename = argv[optind + 2];
+    
+    if (load) {
+	if (num_uris == 0) {
+	    uris = &filename;
+	    num_uris = 1;
+	}
+	load_run(host, port);
+	exit(0);
+    }
     
     /* Open a single connection to the specified host and port */
     clientfd = open_client_fd_or_die(host, port);
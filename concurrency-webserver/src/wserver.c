@@ -1,18 +1,122 @@
+#define _GNU_SOURCE // for accept4
 #include <stdio.h>
 #include "request.h"
 #include "io_helper.h"
+#include "queue.h"
+#include "event.h"
+#include "cache.h"
+#include "fcgi.h"
+#include "stats.h"
+#include "log.h"
+
+#define MAXACCEPTORS (64)
 
 char default_root[] = ".";
 
+queue_t conn_queue;
+int listen_fds[MAXACCEPTORS];
+
+//
+// Each worker thread serves one connection at a time, taken from the buffer
+//
+void *worker(void *arg) {
+    while (1) {
+	request_t *req = queue_get(&conn_queue);
+	int conn_fd = req->fd;
+	rio_t *rio = req->rio;
+	if (req->method == NULL) {
+	    // with FIFO the connection was queued as soon as it was accepted
+	    long accepted = req->t_queued;
+	    request_fill(req);
+	    stats_time(STAT_ACCEPT_WAIT, req->t_read - accepted);
+	}
+	request_serve_connection(req);
+	close_or_die(conn_fd);
+	free(rio);
+    }
+    return NULL;
+}
+
+//
+// Each acceptor thread takes connections from its own listening socket and
+// puts them in the buffer, waiting while it is full. For SFF and SFFA it
+// reads their first requests, so the workers can be handed the smallest
+// file first. Reads on the connection time out after the idle timeout, so
+// a client that sends its request slowly (or never) can't hold the acceptor,
+// or a worker, for long.
+//
+void *acceptor(void *arg) {
+    int listen_fd = listen_fds[(intptr_t) arg];
+    while (1) {
+	struct sockaddr_in client_addr;
+	int client_len = sizeof(client_addr);
+	// close-on-exec, so CGI programs don't keep other clients' connections
+	// open; left blocking, since the workers read it with blocking calls
+	int conn_fd = accept4(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len, SOCK_CLOEXEC);
+	if (conn_fd < 0) {
+	    // out of fds, or the connection was reset before it was accepted
+	    assert(errno == EMFILE || errno == ENFILE || errno == ECONNABORTED || errno == EINTR);
+	    continue;
+	}
+	long accepted = stats_now();
+	stats_count(STAT_CONNECTIONS);
+	// a read that gets nothing for that long fails, and the request with it
+	struct timeval timeout = { .tv_sec = request_idle_timeout > 0 ? request_idle_timeout : 1 };
+	setsockopt_or_die(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	rio_t *rio = malloc(sizeof(rio_t));
+	assert(rio != NULL);
+	rio_init(rio, conn_fd);
+	request_t *req = request_new(conn_fd, rio);
+	if (conn_queue.policy != POLICY_FIFO) {
+	    request_fill(req);
+	    stats_time(STAT_ACCEPT_WAIT, req->t_read - accepted);
+	}
+	queue_put(&conn_queue, req);
+    }
+    return NULL;
+}
+
+//
+// ./wserver [-d <basedir>] [-p <portnum>] [-t <threads>] [-b <buffers>] [-s <schedalg>] [-e <loops>]
+//        [-k <max requests>] [-i <idle timeout>] [-m <cache MB>] [-w <CGI processes>]
+//        [-c <max CGI>] [-l <log file>] [-L <log format>] [-z] [-a <acceptors>] [-q <backlog>]
 //
-// ./wserver [-d <basedir>] [-p <portnum>] 
+// With -e, connections are handled by event loops (0 for one per core) and
+// the worker threads only get the requests that would block a loop.
+// -k is how many requests one connection may make (1 turns keep-alive off)
+// and -i how many seconds a kept-alive connection may be idle. Without -e,
+// -k defaults to 1: a worker stays with its connection until it closes, so
+// one idle client would keep a worker from everyone else for up to -i
+// seconds at a time. Keep-alive only pays there with more workers than
+// clients; with -e it is on by default (100), as an idle connection costs
+// a loop nothing.
+// -m caps the memory used to cache static files (0 turns the cache off).
+// A client that takes gzip gets a file's .gz sibling if it has one, and
+// with -z, text files are also compressed once into the cache for it.
+// -w is how many processes each persistent (.fcgi) CGI program gets, and
+// -c how many other CGI programs may run at once (0 for no limit).
+// Without -e, -a threads accept connections, each from its own listening
+// socket bound with SO_REUSEPORT so the kernel spreads connections over
+// them, and -q is the length of each one's queue of connections.
+// Counters and latencies are served at /__stats, and written to stderr on SIGUSR1.
+// Every request is logged to stdout, or appended to the -l file, in the -L
+// format (see log.h; an empty one turns the log off).
 // 
 int main(int argc, char *argv[]) {
     int c;
     char *root_dir = default_root;
     int port = 10000;
+    int threads = 1;
+    int buffers = 1;
+    policy_t policy = POLICY_FIFO;
+    int loops = -1;
+    int cache_mb = 64;
+    char *log_file = NULL;
+    char *log_format = LOG_DEFAULT_FORMAT;
+    int acceptors = 1;
+    int max_per_conn = -1;
     
-    while ((c = getopt(argc, argv, "d:p:")) != -1)
+    while ((c = getopt(argc, argv, "d:p:t:b:s:e:k:i:m:w:c:l:L:za:q:")) != -1)
 	switch (c) {
 	case 'd':
 	    root_dir = optarg;
@@ -20,23 +124,116 @@ int main(int argc, char *argv[]) {
 	case 'p':
 	    port = atoi(optarg);
 	    break;
+	case 't':
+	    threads = atoi(optarg);
+	    break;
+	case 'b':
+	    buffers = atoi(optarg);
+	    break;
+	case 's':
+	    if (queue_parse_policy(optarg, &policy) < 0) {
+		fprintf(stderr, "wserver: schedalg must be FIFO, SFF or SFFA\n");
+		exit(1);
+	    }
+	    break;
+	case 'e':
+	    loops = atoi(optarg);
+	    break;
+	case 'k':
+	    max_per_conn = atoi(optarg);
+	    break;
+	case 'i':
+	    request_idle_timeout = atoi(optarg);
+	    break;
+	case 'm':
+	    cache_mb = atoi(optarg);
+	    break;
+	case 'w':
+	    fcgi_procs = atoi(optarg);
+	    break;
+	case 'c':
+	    request_max_cgi = atoi(optarg);
+	    break;
+	case 'l':
+	    log_file = optarg;
+	    break;
+	case 'L':
+	    log_format = optarg;
+	    break;
+	case 'z':
+	    request_compress = 1;
+	    break;
+	case 'a':
+	    acceptors = atoi(optarg);
+	    break;
+	case 'q':
+	    listen_backlog = atoi(optarg);
+	    break;
 	default:
-	    fprintf(stderr, "usage: wserver [-d basedir] [-p port]\n");
+	    fprintf(stderr, "usage: wserver [-d basedir] [-p port] [-t threads] [-b buffers] [-s schedalg] [-e loops] [-k max requests] [-i idle timeout] [-m cache MB] [-w CGI processes] [-c max CGI] [-l log file] [-L log format] [-z] [-a acceptors] [-q backlog]\n");
 	    exit(1);
 	}
+    if (threads <= 0 || buffers <= 0 || fcgi_procs <= 0 || listen_backlog <= 0) {
+	fprintf(stderr, "wserver: threads, buffers, CGI processes and backlog must be positive integers\n");
+	exit(1);
+    }
+    if (acceptors <= 0 || acceptors > MAXACCEPTORS) {
+	fprintf(stderr, "wserver: acceptors must be between 1 and %d\n", MAXACCEPTORS);
+	exit(1);
+    }
+    if (cache_mb < 0) {
+	fprintf(stderr, "wserver: cache size must not be negative\n");
+	exit(1);
+    }
+    // a worker stays with a kept-alive connection while it is idle, so
+    // without event loops keep-alive is off unless asked for
+    if (max_per_conn >= 0)
+	request_max_per_conn = max_per_conn;
+    else if (loops < 0)
+	request_max_per_conn = 1;
+    cache_init((size_t) cache_mb << 20);
+    stats_start_dumper();
+    // the log file is named relative to where the server was started
+    int log_fd = STDOUT_FILENO;
+    if (*log_format == '\0')
+	log_fd = -1;
+    else if (log_file != NULL)
+	log_fd = open_or_die(log_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    log_init(log_fd, log_format);
 
     // run out of this directory
     chdir_or_die(root_dir);
 
-    // now, get to work
-    int listen_fd = open_listen_fd_or_die(port);
-    while (1) {
-	struct sockaddr_in client_addr;
-	int client_len = sizeof(client_addr);
-	int conn_fd = accept_or_die(listen_fd, (sockaddr_t *) &client_addr, (socklen_t *) &client_len);
-	request_handle(conn_fd);
-	close_or_die(conn_fd);
+    // sendfile() to a client that has hung up raises SIGPIPE; the failed
+    // call is enough to notice it
+    signal(SIGPIPE, SIG_IGN);
+
+    // start the pool of workers; they wait until there are connections to handle
+    queue_init(&conn_queue, buffers, policy);
+    for (int i = 0; i < threads; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, worker, NULL);
+    }
+
+    if (loops >= 0) {
+	if (loops == 0)
+	    loops = sysconf(_SC_NPROCESSORS_ONLN);
+	event_loops_run(port, loops > 0 ? loops : 1, &conn_queue);
+	return 0;
+    }
+
+    // now, get to work: all the sockets are listening before any thread
+    // accepts, and the master thread becomes the last acceptor. A port some
+    // other server is on is an error, as it is with just one socket.
+    if (acceptors > 1)
+	check_listen_port_or_die(port);
+    for (int i = 0; i < acceptors; i++)
+	listen_fds[i] = acceptors > 1 ? open_reuseport_listen_fd_or_die(port) : open_listen_fd_or_die(port);
+    for (int i = 0; i < acceptors - 1; i++) {
+	pthread_t thread;
+	pthread_create_or_die(&thread, NULL, acceptor, (void *) (intptr_t) i);
     }
+    acceptor((void *) (intptr_t) (acceptors - 1));
     return 0;
 }
 
@@ -1,44 +1,1231 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#define BUFFER_SIZE 256
+#define RECORD_SIZE (5) // 4-byte count followed by 1 char
+#define DEFAULT_NUM_THREADS (4)
+#define WINDOW_SIZE_PER_THREAD (1 << 22)
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+#define STREAM_BUFFER_SIZE (RECORD_SIZE << 18)
 
-// returns 0 on success, 1 on failure
-int readEntry(FILE *fp) {
-  int numChars;
-  char currChar;
-  if (fread(&numChars, sizeof(int), 1, fp) != 1
-      || fread(&currChar, sizeof(char), 1, fp) != 1) {
-    return 1;
+// indexed files from pzip -i. see pzip.c for the layout, this has to match it.
+#define INDEXED_MAGIC "WZI\x89"
+#define MAGIC_SIZE (4)
+#define INDEXED_HEADER_SIZE (MAGIC_SIZE + sizeof(uint32_t))
+#define INDEXED_TRAILER_SIZE (2 * sizeof(uint64_t) + MAGIC_SIZE)
+#define INDEXED_END_COUNT (-1)
+
+// entropy coded files from pzip -e, see pzip.c for the layout
+#define ENTROPY_MAGIC "WZH\x89"
+#define MAX_CODE_LEN (12)
+#define ENTROPY_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint64_t) + 128)
+
+// compact files from pzip -c: varint run and literal tokens, see pzip.c
+#define COMPACT_MAGIC "WZV\x89"
+#define COMPACT_READ_SIZE (1 << 16)
+
+/*
+
+  How the parallel decode works:
+
+  1. Every input file is mapped and its records are numbered one after another
+  across all of the files.
+  2. The threads each sum the run lengths of a slice of the records. A serial
+  pass over the slice totals turns those into starting offsets, and then each
+  thread writes the output offset of every record in its slice. After this,
+  offsets[r] is where record r starts in the uncompressed output and
+  offsets[num_records] is the total output size.
+  3. The output is split into byte ranges, one per thread. A thread binary
+  searches offsets for the record containing the start of its range and
+  memsets runs from there until the range is full.
+
+  If stdout is a regular file, it is grown to the final size and mapped, so the
+  threads write straight into it. Otherwise (a pipe or a terminal) the output is
+  produced one window at a time into a buffer which is written out in order.
+
+  With -r start:end only bytes [start, end) of the output are produced. If all
+  of the inputs are indexed, the index is used to jump straight to the records
+  near start, so nothing before them has to be read. Otherwise the offsets of
+  every record are still needed and the same parallel decode is used.
+
+  Entropy coded files (pzip -e) are made of independent blocks, and the block
+  headers say how much output each one makes. So their offsets come from one
+  quick pass over the headers, and the threads then take whole blocks, undo the
+  Huffman code and memset the runs into place. When those are mixed with other
+  inputs, the files are decoded one at a time.
+
+  Compact files (pzip -c) have no offsets to start from in the middle, so each
+  one is decoded by a single pass on the main thread.
+
+  Inputs that can't be mapped ("-" for stdin, pipes) are streamed instead. A
+  reader thread fills one of two buffers with whole records while the main
+  thread decodes the other one, so memory use stays fixed no matter how big the
+  input is.
+
+*/
+
+typedef struct block_t {
+  uint8_t *coded;
+  uint32_t coded_len;
+  uint32_t raw_len;      // bytes of char + varint pairs
+  uint64_t uncompressed;
+  uint64_t offset;       // where the block's output starts, within its file
+  uint8_t lens[256];
+} block_t;
+
+typedef struct input_t {
+  char *map;
+  size_t map_size;
+  char *text;          // the records, after any header
+  size_t size;
+  size_t first_record; // global number of this file's first record
+  bool indexed;
+  bool entropy_coded;
+  bool compact;
+  uint64_t uncompressed; // only for indexed and entropy coded files
+  uint32_t interval;   // only for indexed files
+  uint64_t *index;
+  uint64_t num_entries;
+  block_t *blocks;     // only for entropy coded files
+  size_t num_blocks;
+} input_t;
+
+input_t *inputs;
+int num_inputs;
+size_t num_records;
+size_t *offsets;
+int num_threads;
+
+// work for one thread: a slice of records for the prefix sum,
+// or a range of output bytes to fill for the decode.
+typedef struct thread_args_t {
+  size_t start;
+  size_t end;
+  size_t sum;
+  char *out;      // where output byte `start` goes
+  void *(*func)(struct thread_args_t *);
+} thread_args_t;
+
+void die(char *msg) {
+  printf("wunzip: %s\n", msg);
+  exit(1);
+}
+
+void *malloc_or_die(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr == NULL) {
+    die("out of memory");
   }
-  for (int i = 0; i < numChars; i++) {
-    printf("%c", currChar);
+  return ptr;
+}
+
+// the input file holding global record r
+int find_input(size_t r) {
+  int lo = 0;
+  int hi = num_inputs - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (inputs[mid].first_record <= r) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
   }
-  return 0;
+  return lo;
 }
 
-int main(int argc, char **argv) {
-  if (argc == 1) {
-    printf("wunzip: file1 [file2 ...]\n");
-    return 1;
-  } else {
+// runs body for records [start, end) in order, with r, len and c set to the
+// record number, its run length and its character
+#define FOR_EACH_RECORD(start, end, body) { \
+  size_t r = (start); \
+  for (int f = find_input(r); r < (end); f++) { \
+    input_t *input = &inputs[f]; \
+    size_t last = input->first_record + input->size / RECORD_SIZE; \
+    if (last > (end)) { \
+      last = (end); \
+    } \
+    char *rec = input->text + (r - input->first_record) * RECORD_SIZE; \
+    for (; r < last; r++, rec += RECORD_SIZE) { \
+      int count; \
+      memcpy(&count, rec, sizeof(int)); \
+      size_t len = count > 0 ? (size_t) count : 0; \
+      char c = rec[sizeof(int)]; \
+      body; \
+    } \
+  } \
+}
+
+void *sum_slice(thread_args_t *args) {
+  size_t sum = 0;
+  FOR_EACH_RECORD(args->start, args->end, { (void) c; sum += len; });
+  args->sum = sum;
+  return NULL;
+}
+
+void *fill_offsets(thread_args_t *args) {
+  size_t offset = args->sum;
+  FOR_EACH_RECORD(args->start, args->end, { (void) c; offsets[r] = offset; offset += len; });
+  return NULL;
+}
+
+// the record whose run covers output byte pos
+size_t find_record(size_t pos) {
+  size_t lo = 0;
+  size_t hi = num_records - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (offsets[mid] <= pos) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+void *decode_range(thread_args_t *args) {
+  size_t pos = args->start;
+  if (pos >= args->end) {
+    return NULL;
+  }
+  char *out = args->out;
+  FOR_EACH_RECORD(find_record(pos), num_records, {
+    size_t run_end = offsets[r] + len;
+    if (run_end > args->end) {
+      run_end = args->end;
+    }
+    if (run_end > pos) {
+      memset(out, c, run_end - pos);
+      out += run_end - pos;
+      pos = run_end;
+    }
+    if (pos == args->end) {
+      return NULL;
+    }
+  });
+  return NULL;
+}
+
+void *thread_func(void *args) {
+  thread_args_t *thread_args = (thread_args_t *) args;
+  return thread_args->func(thread_args);
+}
+
+void run_threads(thread_args_t *thread_args) {
+  pthread_t *threads = (pthread_t *) malloc_or_die(sizeof(pthread_t) * num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, &thread_func, &thread_args[i]) != 0) {
+      die("cannot create thread");
+    }
+  }
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_join(threads[i], NULL) != 0) {
+      die("cannot join thread");
+    }
+  }
+  free(threads);
+}
+
+// splits [start, end) evenly over the threads
+void split_range(thread_args_t *thread_args, size_t start, size_t end,
+                 void *(*func)(thread_args_t *)) {
+  size_t per_thread = (end - start) / num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    thread_args[i].start = start + i * per_thread;
+    thread_args[i].end = start + (i + 1) * per_thread;
+    thread_args[i].func = func;
+  }
+  thread_args[num_threads - 1].end = end;
+}
+
+void compute_offsets(thread_args_t *thread_args) {
+  offsets = (size_t *) malloc_or_die(sizeof(size_t) * (num_records + 1));
+  split_range(thread_args, 0, num_records, &sum_slice);
+  run_threads(thread_args);
+
+  size_t total = 0;
+  for (int i = 0; i < num_threads; i++) {
+    size_t sum = thread_args[i].sum;
+    thread_args[i].sum = total;
+    thread_args[i].func = &fill_offsets;
+    total += sum;
+  }
+  run_threads(thread_args);
+  offsets[num_records] = total;
+}
+
+void write_all(int fd, char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t rc = write(fd, buf, len);
+    if (rc < 0) {
+      die("cannot write output");
+    }
+    buf += rc;
+    len -= rc;
+  }
+}
+
+typedef void (*decode_func_t)(thread_args_t *thread_args, char *out, size_t start, size_t end);
+
+// decodes [start, end) of the output into out, split over the threads
+void decode(thread_args_t *thread_args, char *out, size_t start, size_t end) {
+  split_range(thread_args, start, end, &decode_range);
+  for (int i = 0; i < num_threads; i++) {
+    thread_args[i].out = out + (thread_args[i].start - start);
+  }
+  run_threads(thread_args);
+}
+
+// returns true if the output could be decoded straight into a mapping of stdout
+bool decode_to_mapped_stdout(thread_args_t *thread_args, size_t start, size_t end, decode_func_t decode) {
+  size_t total = end - start;
+  struct stat statbuf;
+  int flags = fcntl(STDOUT_FILENO, F_GETFL);
+  if (flags < 0 || fstat(STDOUT_FILENO, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+    return false;
+  }
+  // a shared writable mapping needs a read/write descriptor, but the shell
+  // opens redirections write-only. reopening the same file through /dev/fd
+  // gets us one (on Linux) without changing what stdout points at.
+  int map_fd = STDOUT_FILENO;
+  if ((flags & O_ACCMODE) != O_RDWR) {
+    map_fd = open("/dev/fd/1", O_RDWR);
+    if (map_fd < 0) {
+      return false;
+    }
+  }
+
+  // with >> the offset only moves to the end on the next write, so go there now
+  off_t base = lseek(STDOUT_FILENO, 0, (flags & O_APPEND) ? SEEK_END : SEEK_CUR);
+  // mmap offsets have to be page aligned
+  off_t aligned = base - base % sysconf(_SC_PAGESIZE);
+  size_t map_size = total + (base - aligned);
+  char *map = MAP_FAILED;
+  if (base >= 0 && (base + total <= statbuf.st_size || ftruncate(map_fd, base + total) == 0)) {
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, aligned);
+  }
+  if (map_fd != STDOUT_FILENO) {
+    close(map_fd);
+  }
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  decode(thread_args, map + (base - aligned), start, end);
+  if (munmap(map, map_size) != 0 || lseek(STDOUT_FILENO, base + total, SEEK_SET) < 0) {
+    die("cannot write output");
+  }
+  return true;
+}
+
+// produces [start, end) of the output, either straight into stdout or a window at a time
+void decode_output(thread_args_t *thread_args, size_t start, size_t end, decode_func_t decode) {
+  if (start >= end || decode_to_mapped_stdout(thread_args, start, end, decode)) {
+    return;
+  }
+  size_t window_size = (size_t) num_threads * WINDOW_SIZE_PER_THREAD;
+  char *window = (char *) malloc_or_die(window_size);
+  for (size_t from = start; from < end; from += window_size) {
+    size_t to = from + window_size < end ? from + window_size : end;
+    decode(thread_args, window, from, to);
+    write_all(STDOUT_FILENO, window, to - from);
+  }
+  free(window);
+}
+
+// decodes [start, end) of the record files in inputs (clipped to what they
+// hold), returns how much output they hold in total
+size_t decode_records(thread_args_t *thread_args, size_t start, size_t end) {
+  if (num_records == 0) {
+    return 0;
+  }
+  compute_offsets(thread_args);
+  size_t total = offsets[num_records];
+  decode_output(thread_args, start, end < total ? end : total, &decode);
+  free(offsets);
+  return total;
+}
+
+// entropy coded files
+
+block_t *blocks;  // of the entropy coded file being decoded
+size_t num_blocks;
+size_t next_block;
+pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// reads a block header, returns how many coded bytes follow it
+uint32_t parse_block_header(char *header, block_t *block) {
+  memcpy(&block->coded_len, header, sizeof(uint32_t));
+  memcpy(&block->raw_len, header + sizeof(uint32_t), sizeof(uint32_t));
+  memcpy(&block->uncompressed, header + 2 * sizeof(uint32_t), sizeof(uint64_t));
+  uint8_t *packed = (uint8_t *) header + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+  for (int sym = 0; sym < 256; sym += 2) {
+    block->lens[sym] = packed[sym / 2] >> 4;
+    block->lens[sym + 1] = packed[sym / 2] & 0xf;
+  }
+  return block->coded_len;
+}
+
+// undoes a block's Huffman code into raw, which must hold raw_len bytes.
+// table maps the next MAX_CODE_LEN bits to (symbol << 4 | code length).
+void huffman_decode(block_t *block, uint8_t *raw) {
+  uint16_t table[1 << MAX_CODE_LEN];
+  memset(table, 0, sizeof(table));
+  int len_counts[MAX_CODE_LEN + 1] = { 0 };
+  for (int sym = 0; sym < 256; sym++) {
+    if (block->lens[sym] > MAX_CODE_LEN) {
+      die("corrupt entropy coded file");
+    }
+    len_counts[block->lens[sym]]++;
+  }
+  // canonical codes, the same way pzip.c assigns them
+  uint16_t next_code[MAX_CODE_LEN + 1];
+  uint16_t code = 0;
+  len_counts[0] = 0;
+  for (int len = 1; len <= MAX_CODE_LEN; len++) {
+    code = (code + len_counts[len - 1]) << 1;
+    next_code[len] = code;
+  }
+  for (int sym = 0; sym < 256; sym++) {
+    int len = block->lens[sym];
+    if (len == 0) {
+      continue;
+    }
+    uint32_t first = (uint32_t) next_code[len]++ << (MAX_CODE_LEN - len);
+    uint32_t last = first + (1 << (MAX_CODE_LEN - len));
+    if (last > (1 << MAX_CODE_LEN)) {
+      die("corrupt entropy coded file");
+    }
+    for (uint32_t i = first; i < last; i++) {
+      table[i] = (sym << 4) | len;
+    }
+  }
+
+  uint64_t acc = 0;
+  int num_bits = 0;
+  uint32_t next_byte = 0;
+  for (uint32_t i = 0; i < block->raw_len; i++) {
+    while (num_bits <= 56) {
+      // past the end is read as zeros, the count stops us in time
+      uint8_t byte = next_byte < block->coded_len ? block->coded[next_byte] : 0;
+      next_byte++;
+      acc |= (uint64_t) byte << (56 - num_bits);
+      num_bits += 8;
+    }
+    uint16_t entry = table[acc >> (64 - MAX_CODE_LEN)];
+    int len = entry & 0xf;
+    if (len == 0) {
+      die("corrupt entropy coded file");
+    }
+    raw[i] = entry >> 4;
+    acc <<= len;
+    num_bits -= len;
+  }
+}
+
+// reads the char + varint count pair at raw[i], returns where the next one starts
+size_t read_raw_record(uint8_t *raw, size_t i, size_t raw_len, size_t *count, char *c) {
+  *c = raw[i++];
+  *count = 0;
+  for (int shift = 0; i < raw_len; shift += 7) {
+    uint8_t byte = raw[i++];
+    *count |= (size_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return i;
+}
+
+// every thread gets the same window here and takes whole blocks from next_block
+void *decode_blocks(thread_args_t *args) {
+  uint8_t *raw = NULL;
+  size_t raw_size = 0;
+  while (true) {
+    pthread_mutex_lock(&block_lock);
+    size_t b = next_block++;
+    pthread_mutex_unlock(&block_lock);
+    if (b >= num_blocks || blocks[b].offset >= args->end) {
+      break;
+    }
+    block_t *block = &blocks[b];
+    if (raw_size < block->raw_len) {
+      free(raw);
+      raw_size = block->raw_len;
+      raw = (uint8_t *) malloc_or_die(raw_size);
+    }
+    huffman_decode(block, raw);
+
+    size_t pos = block->offset;
+    for (size_t i = 0; i < block->raw_len && pos < args->end; ) {
+      size_t count;
+      char c;
+      i = read_raw_record(raw, i, block->raw_len, &count, &c);
+      size_t from = pos > args->start ? pos : args->start;
+      pos += count;
+      size_t to = pos < args->end ? pos : args->end;
+      if (from < to) {
+        memset(args->out + (from - args->start), c, to - from);
+      }
+    }
+  }
+  free(raw);
+  return NULL;
+}
+
+void decode_block_window(thread_args_t *thread_args, char *out, size_t start, size_t end) {
+  // start from the last block that begins at or before start
+  size_t lo = 0;
+  size_t hi = num_blocks - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo + 1) / 2;
+    if (blocks[mid].offset <= start) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  next_block = lo;
+  for (int i = 0; i < num_threads; i++) {
+    thread_args[i].start = start;
+    thread_args[i].end = end;
+    thread_args[i].out = out;
+    thread_args[i].func = &decode_blocks;
+  }
+  run_threads(thread_args);
+}
+
+// decodes [start, end) of an entropy coded file, returns its total output size
+size_t decode_entropy_coded(thread_args_t *thread_args, input_t *input, size_t start, size_t end) {
+  blocks = input->blocks;
+  num_blocks = input->num_blocks;
+  if (num_blocks > 0) {
+    size_t total = input->uncompressed;
+    decode_output(thread_args, start, end < total ? end : total, &decode_block_window);
+  }
+  return input->uncompressed;
+}
+
+// a buffered writer for the serial decoders. pos counts every output byte,
+// including the ones outside [start, end) that are skipped.
+typedef struct output_t {
+  char *buf;
+  size_t len;
+  size_t pos;
+  size_t start;
+  size_t end;
+} output_t;
+
+void output_init(output_t *out, size_t start, size_t end) {
+  out->buf = (char *) malloc_or_die(OUTPUT_BUFFER_SIZE);
+  out->len = 0;
+  out->pos = 0;
+  out->start = start;
+  out->end = end;
+}
+
+void output_run(output_t *out, size_t len, char c) {
+  size_t from = out->pos > out->start ? out->pos : out->start;
+  out->pos += len;
+  size_t to = out->pos < out->end ? out->pos : out->end;
+  while (from < to) {
+    size_t n = to - from;
+    if (n > OUTPUT_BUFFER_SIZE - out->len) {
+      n = OUTPUT_BUFFER_SIZE - out->len;
+    }
+    memset(out->buf + out->len, c, n);
+    out->len += n;
+    from += n;
+    if (out->len == OUTPUT_BUFFER_SIZE) {
+      write_all(STDOUT_FILENO, out->buf, out->len);
+      out->len = 0;
+    }
+  }
+}
+
+void output_finish(output_t *out) {
+  write_all(STDOUT_FILENO, out->buf, out->len);
+  free(out->buf);
+}
+
+// like output_run, but for len bytes copied from bytes
+void output_bytes(output_t *out, char *bytes, size_t len) {
+  size_t from = out->pos > out->start ? out->pos : out->start;
+  size_t skip = from - out->pos;
+  out->pos += len;
+  size_t to = out->pos < out->end ? out->pos : out->end;
+  bytes += skip;
+  while (from < to) {
+    size_t n = to - from;
+    if (n > OUTPUT_BUFFER_SIZE - out->len) {
+      n = OUTPUT_BUFFER_SIZE - out->len;
+    }
+    memcpy(out->buf + out->len, bytes, n);
+    out->len += n;
+    bytes += n;
+    from += n;
+    if (out->len == OUTPUT_BUFFER_SIZE) {
+      write_all(STDOUT_FILENO, out->buf, out->len);
+      out->len = 0;
+    }
+  }
+}
 
-    for (int i = 1; i < argc; i++) {
-      char *filename = argv[i];
-      FILE* fp = fopen(filename, "r");
-      if (fp == NULL) {
-        printf("wunzip: cannot open file\n");
-        return 1;
+// writes bytes [start, end) of the output using the indexes of the inputs
+void decode_indexed_range(size_t start, size_t end) {
+  output_t out;
+  output_init(&out, start, end);
+  size_t base = 0; // output offset of the current input's first byte
+  for (int f = 0; f < num_inputs && base < end; base += inputs[f].uncompressed, f++) {
+    input_t *input = &inputs[f];
+    if (base + input->uncompressed <= start) {
+      continue;
+    }
+
+    // the last index entry at or before start
+    if (input->num_entries == 0) {
+      die("corrupt indexed file");
+    }
+    uint64_t lo = 0;
+    uint64_t hi = input->num_entries - 1;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo + 1) / 2;
+      if (base + input->index[2 * mid] <= start) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+
+    out.pos = base + input->index[2 * lo];
+    char *rec = input->map + input->index[2 * lo + 1];
+    char *records_end = input->text + input->size - input->size % RECORD_SIZE;
+    for (; rec < records_end && out.pos < end; rec += RECORD_SIZE) {
+      int count;
+      memcpy(&count, rec, sizeof(int));
+      output_run(&out, count > 0 ? count : 0, rec[sizeof(int)]);
+    }
+  }
+  output_finish(&out);
+}
+
+// compact files
+
+// reads the header of the token at in[i] into *header. returns where the
+// token's payload starts, or 0 if the token doesn't fit in len bytes.
+size_t read_compact_token(uint8_t *in, size_t i, size_t len, uint64_t *header) {
+  *header = 0;
+  for (int shift = 0; ; shift += 7) {
+    if (i == len || shift > 63) {
+      return 0;
+    }
+    uint8_t byte = in[i++];
+    *header |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  // a run is followed by its char, literals by themselves
+  uint64_t payload = (*header & 1) ? *header >> 1 : 1;
+  return payload <= len - i ? i : 0;
+}
+
+// writes [start, end) of a compact file's output, returns its total size
+size_t decode_compact(input_t *input, size_t start, size_t end) {
+  output_t out;
+  output_init(&out, start, end);
+  uint8_t *in = (uint8_t *) input->text;
+  size_t i = 0;
+  while (i < input->size) {
+    uint64_t header;
+    i = read_compact_token(in, i, input->size, &header);
+    if (i == 0) {
+      die("corrupt compact file");
+    }
+    if (header & 1) {
+      output_bytes(&out, (char *) in + i, header >> 1);
+      i += header >> 1;
+    } else {
+      output_run(&out, header >> 1, in[i]);
+      i++;
+    }
+  }
+  output_finish(&out);
+  return out.pos;
+}
+
+// streaming
+
+typedef struct stream_t {
+  char **filenames;
+  int num_files;
+  char *bufs[2];
+  size_t lens[2];
+  bool full[2];
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} stream_t;
+
+// reads until len bytes are in or the file ends, returns how many were read
+size_t read_full(int fd, char *buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t rc = read(fd, buf + got, len - got);
+    if (rc < 0) {
+      die("cannot read file");
+    }
+    if (rc == 0) {
+      break;
+    }
+    got += rc;
+  }
+  return got;
+}
+
+// a growable byte buffer
+typedef struct buffer_t {
+  char *data;
+  size_t len;
+  size_t size;
+} buffer_t;
+
+void buffer_init(buffer_t *buffer) {
+  buffer->data = NULL;
+  buffer->len = 0;
+  buffer->size = 0;
+}
+
+void buffer_reserve(buffer_t *buffer, size_t size) {
+  if (buffer->size < size) {
+    buffer->size = size;
+    buffer->data = (char *) realloc(buffer->data, size);
+    if (buffer->data == NULL) {
+      die("out of memory");
+    }
+  }
+}
+
+// reads the next block of an entropy coded file and turns it into plain
+// records in out. returns 0 at the end of the file, 1 otherwise.
+int stream_read_block(int fd, buffer_t *out) {
+  char header[ENTROPY_HEADER_SIZE];
+  size_t got = read_full(fd, header, ENTROPY_HEADER_SIZE);
+  out->len = 0;
+  if (got == 0) {
+    return 0;
+  }
+  block_t block;
+  if (got < ENTROPY_HEADER_SIZE) {
+    die("corrupt entropy coded file");
+  }
+  parse_block_header(header, &block);
+  block.coded = (uint8_t *) malloc_or_die(block.coded_len + 1);
+  uint8_t *raw = (uint8_t *) malloc_or_die(block.raw_len + 1);
+  if (read_full(fd, (char *) block.coded, block.coded_len) != block.coded_len) {
+    die("corrupt entropy coded file");
+  }
+  huffman_decode(&block, raw);
+
+  // every pair is at least 2 bytes, so there are at most raw_len / 2 records
+  buffer_reserve(out, block.raw_len / 2 * RECORD_SIZE + RECORD_SIZE);
+  for (size_t i = 0; i < block.raw_len; ) {
+    size_t count;
+    char c;
+    i = read_raw_record(raw, i, block.raw_len, &count, &c);
+    int count32 = count;
+    memcpy(out->data + out->len, &count32, sizeof(int));
+    out->data[out->len + sizeof(int)] = c;
+    out->len += RECORD_SIZE;
+  }
+  free(block.coded);
+  free(raw);
+  return 1;
+}
+
+// reads more of a compact file into in and turns the whole tokens in it into
+// plain records in out. anything left over stays at the front of in for the
+// next call. returns 0 at the end of the file, 1 otherwise.
+int stream_read_compact(int fd, buffer_t *in, buffer_t *out) {
+  buffer_reserve(in, in->len + COMPACT_READ_SIZE);
+  size_t got = read_full(fd, in->data + in->len, COMPACT_READ_SIZE);
+  in->len += got;
+  out->len = 0;
+
+  uint8_t *bytes = (uint8_t *) in->data;
+  size_t i = 0;
+  while (i < in->len) {
+    uint64_t header;
+    size_t payload = read_compact_token(bytes, i, in->len, &header);
+    if (payload == 0) {
+      break;
+    }
+    // long runs are split so every count fits in a record
+    size_t num_records = (header & 1) ? header >> 1 : (header >> 1) / INT_MAX + 1;
+    buffer_reserve(out, out->len + num_records * RECORD_SIZE);
+    if (header & 1) {
+      for (size_t j = 0; j < header >> 1; j++) {
+        int count = 1;
+        memcpy(out->data + out->len, &count, sizeof(int));
+        out->data[out->len + sizeof(int)] = bytes[payload + j];
+        out->len += RECORD_SIZE;
+      }
+      i = payload + (header >> 1);
+    } else {
+      for (uint64_t left = header >> 1; left > 0; ) {
+        int count = left < INT_MAX ? left : INT_MAX;
+        memcpy(out->data + out->len, &count, sizeof(int));
+        out->data[out->len + sizeof(int)] = bytes[payload];
+        out->len += RECORD_SIZE;
+        left -= count;
+      }
+      i = payload + 1;
+    }
+  }
+  memmove(in->data, in->data + i, in->len - i);
+  in->len -= i;
+  if (got == 0) {
+    // a token cut off at the end of the file is dropped, like a truncated record
+    in->len = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// reads the files one after another and hands the main thread buffers that
+// hold only whole records. headers, end markers and indexes of indexed files
+// are dropped here, as is a truncated record at the end of a file. entropy
+// coded blocks and compact tokens are decoded here too, into plain records.
+// a buffer with no records in it means everything has been read.
+void *stream_reader(void *stream_void) {
+  stream_t *stream = (stream_t *) stream_void;
+  char carry[RECORD_SIZE]; // start of a record that didn't fit in the last buffer
+  size_t carry_len = 0;
+  int f = 0;
+  int fd = -1;
+  bool indexed = false;
+  bool entropy_coded = false;
+  bool compact = false;
+  bool records_done = false;
+  buffer_t pending; // records of an entropy coded block or compact tokens still to be handed over
+  size_t pending_pos = 0;
+  buffer_init(&pending);
+  buffer_t compact_in; // bytes of a compact file that don't make a whole token yet
+  buffer_init(&compact_in);
+  for (int b = 0; ; b = 1 - b) {
+    pthread_mutex_lock(&stream->lock);
+    while (stream->full[b]) {
+      pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+
+    char *buf = stream->bufs[b];
+    memcpy(buf, carry, carry_len);
+    size_t len = carry_len;
+    size_t checked = 0; // records before this have been checked for the end marker
+    while (f < stream->num_files) {
+      char *filename = stream->filenames[f];
+      if (fd < 0) {
+        if (len + MAGIC_SIZE > STREAM_BUFFER_SIZE) {
+          break;
+        }
+        fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+        if (fd < 0) {
+          die("cannot open file");
+        }
+        size_t got = read_full(fd, buf + len, MAGIC_SIZE);
+        indexed = got == MAGIC_SIZE && memcmp(buf + len, INDEXED_MAGIC, MAGIC_SIZE) == 0;
+        entropy_coded = got == MAGIC_SIZE && memcmp(buf + len, ENTROPY_MAGIC, MAGIC_SIZE) == 0;
+        compact = got == MAGIC_SIZE && memcmp(buf + len, COMPACT_MAGIC, MAGIC_SIZE) == 0;
+        checked = len;
+        if (entropy_coded || compact) {
+          // nothing else in the header
+        } else if (indexed) {
+          uint32_t interval;
+          read_full(fd, (char *) &interval, sizeof(uint32_t));
+        } else {
+          len += got;
+        }
+        records_done = false;
+      }
+
+      ssize_t rc = 0;
+      if (entropy_coded || compact) {
+        if (pending_pos == pending.len) {
+          pending_pos = 0;
+          rc = entropy_coded ? stream_read_block(fd, &pending) : stream_read_compact(fd, &compact_in, &pending);
+        }
+        if (pending_pos < pending.len) {
+          size_t n = pending.len - pending_pos;
+          size_t room = (STREAM_BUFFER_SIZE - len) / RECORD_SIZE * RECORD_SIZE;
+          if (room == 0) {
+            break;
+          }
+          n = n < room ? n : room;
+          memcpy(buf + len, pending.data + pending_pos, n);
+          len += n;
+          pending_pos += n;
+          continue;
+        }
+      } else if (!records_done) {
+        if (len == STREAM_BUFFER_SIZE) {
+          break;
+        }
+        rc = read(fd, buf + len, STREAM_BUFFER_SIZE - len);
+        if (rc < 0) {
+          die("cannot read file");
+        }
+        len += rc;
+      } else {
+        // skip over the index and trailer
+        char discard[OUTPUT_BUFFER_SIZE];
+        rc = read(fd, discard, sizeof(discard));
+        if (rc < 0) {
+          die("cannot read file");
+        }
+      }
+
+      if (indexed && !records_done) {
+        for (; checked + RECORD_SIZE <= len; checked += RECORD_SIZE) {
+          int count;
+          memcpy(&count, buf + checked, sizeof(int));
+          if (count == INDEXED_END_COUNT) {
+            len = checked;
+            records_done = true;
+            break;
+          }
+        }
+      }
+
+      if (rc == 0) {
+        // drop a truncated record at the end of the file
+        len -= len % RECORD_SIZE;
+        checked = len;
+        if (fd != STDIN_FILENO && close(fd) != 0) {
+          die("cannot close file");
+        }
+        fd = -1;
+        f++;
+      }
+    }
+    carry_len = len % RECORD_SIZE;
+    memcpy(carry, buf + len - carry_len, carry_len);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->lens[b] = len - carry_len;
+    stream->full[b] = true;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+    if (len == 0) {
+      free(pending.data);
+      free(compact_in.data);
+      return NULL;
+    }
+  }
+}
+
+void decode_stream(char **filenames, int num_files, size_t start, size_t end) {
+  stream_t stream;
+  stream.filenames = filenames;
+  stream.num_files = num_files;
+  for (int b = 0; b < 2; b++) {
+    stream.bufs[b] = (char *) malloc_or_die(STREAM_BUFFER_SIZE);
+    stream.full[b] = false;
+  }
+  pthread_mutex_init(&stream.lock, NULL);
+  pthread_cond_init(&stream.changed, NULL);
+
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, &stream_reader, &stream) != 0) {
+    die("cannot create thread");
+  }
+
+  output_t out;
+  output_init(&out, start, end);
+  for (int b = 0; ; b = 1 - b) {
+    pthread_mutex_lock(&stream.lock);
+    while (!stream.full[b]) {
+      pthread_cond_wait(&stream.changed, &stream.lock);
+    }
+    size_t len = stream.lens[b];
+    pthread_mutex_unlock(&stream.lock);
+    if (len == 0) {
+      break;
+    }
+
+    char *buf = stream.bufs[b];
+    for (size_t i = 0; i < len && out.pos < end; i += RECORD_SIZE) {
+      int count;
+      memcpy(&count, buf + i, sizeof(int));
+      output_run(&out, count > 0 ? count : 0, buf[i + sizeof(int)]);
+    }
+
+    pthread_mutex_lock(&stream.lock);
+    stream.full[b] = false;
+    pthread_cond_broadcast(&stream.changed);
+    pthread_mutex_unlock(&stream.lock);
+  }
+  output_finish(&out);
+
+  if (pthread_join(reader, NULL) != 0) {
+    die("cannot join thread");
+  }
+  for (int b = 0; b < 2; b++) {
+    free(stream.bufs[b]);
+  }
+  pthread_mutex_destroy(&stream.lock);
+  pthread_cond_destroy(&stream.changed);
+}
+
+// maps the file and finds its records. if it is indexed, checks the header
+// and trailer and finds the index.
+void input_open(input_t *input, char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    die("cannot open file");
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0) {
+    die("cannot open file");
+  }
+  input->map_size = statbuf.st_size;
+  input->map = NULL;
+  if (input->map_size > 0) {
+    input->map = mmap(NULL, input->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (input->map == MAP_FAILED) {
+      die("cannot open file");
+    }
+  }
+  if (close(fd) != 0) {
+    die("cannot close file");
+  }
+
+  input->text = input->map;
+  input->size = input->map_size;
+  input->indexed = input->size >= MAGIC_SIZE && memcmp(input->map, INDEXED_MAGIC, MAGIC_SIZE) == 0;
+  input->entropy_coded = input->size >= MAGIC_SIZE && memcmp(input->map, ENTROPY_MAGIC, MAGIC_SIZE) == 0;
+  input->compact = input->size >= MAGIC_SIZE && memcmp(input->map, COMPACT_MAGIC, MAGIC_SIZE) == 0;
+  if (input->compact) {
+    input->text = input->map + MAGIC_SIZE;
+    input->size = input->map_size - MAGIC_SIZE;
+    return;
+  }
+  if (input->entropy_coded) {
+    // walk the block headers to find every block and where its output goes
+    input->size = 0;
+    input->uncompressed = 0;
+    input->num_blocks = 0;
+    size_t blocks_size = 16;
+    input->blocks = (block_t *) malloc_or_die(sizeof(block_t) * blocks_size);
+    size_t pos = MAGIC_SIZE;
+    while (pos < input->map_size) {
+      if (input->num_blocks == blocks_size) {
+        blocks_size *= 2;
+        input->blocks = (block_t *) realloc(input->blocks, sizeof(block_t) * blocks_size);
+        if (input->blocks == NULL) {
+          die("out of memory");
+        }
+      }
+      block_t *block = &input->blocks[input->num_blocks++];
+      if (input->map_size - pos < ENTROPY_HEADER_SIZE
+          || parse_block_header(input->map + pos, block) > input->map_size - pos - ENTROPY_HEADER_SIZE) {
+        die("corrupt entropy coded file");
       }
+      block->coded = (uint8_t *) input->map + pos + ENTROPY_HEADER_SIZE;
+      block->offset = input->uncompressed;
+      input->uncompressed += block->uncompressed;
+      pos += ENTROPY_HEADER_SIZE + block->coded_len;
+    }
+    return;
+  }
+  if (!input->indexed) {
+    return;
+  }
 
-      while (readEntry(fp) != 1) {}
+  char *trailer = input->map + input->map_size - INDEXED_TRAILER_SIZE;
+  if (input->map_size < INDEXED_HEADER_SIZE + RECORD_SIZE + INDEXED_TRAILER_SIZE
+      || memcmp(trailer + 2 * sizeof(uint64_t), INDEXED_MAGIC, MAGIC_SIZE) != 0) {
+    die("corrupt indexed file");
+  }
+  memcpy(&input->interval, input->map + MAGIC_SIZE, sizeof(uint32_t));
+  memcpy(&input->num_entries, trailer, sizeof(uint64_t));
+  memcpy(&input->uncompressed, trailer + sizeof(uint64_t), sizeof(uint64_t));
+  size_t max_size = input->map_size - INDEXED_HEADER_SIZE - RECORD_SIZE - INDEXED_TRAILER_SIZE;
+  if (input->interval == 0 || input->num_entries > max_size / (2 * sizeof(uint64_t))) {
+    die("corrupt indexed file");
+  }
+  size_t index_size = input->num_entries * 2 * sizeof(uint64_t);
+  input->text = input->map + INDEXED_HEADER_SIZE;
+  input->size = trailer - index_size - input->text - RECORD_SIZE;
+  int end_count;
+  memcpy(&end_count, input->text + input->size, sizeof(int));
+  if (end_count != INDEXED_END_COUNT || input->size % RECORD_SIZE != 0
+      || input->size / RECORD_SIZE > input->num_entries * input->interval
+      || (input->num_entries == 0 && input->uncompressed > 0)) {
+    die("corrupt indexed file");
+  }
 
-      int close = fclose(fp);
-      if (close != 0) {
-        printf("wunzip: cannot close file\n");
-        return 1;
+  // the index sits at whatever alignment the records left it at, so it is
+  // copied out. decode_indexed_range trusts it, so every entry has to point
+  // at a record, both offsets have to grow from the first record on, and
+  // the runs before each entry have to add up to its position.
+  input->index = (uint64_t *) malloc_or_die(index_size + 1);
+  memcpy(input->index, trailer - index_size, index_size);
+  uint64_t text_start = input->text - input->map;
+  for (uint64_t i = 0; i < input->num_entries; i++) {
+    uint64_t pos = input->index[2 * i];
+    uint64_t offset = input->index[2 * i + 1];
+    bool first = i == 0;
+    if (pos > input->uncompressed || offset < text_start || offset >= text_start + input->size
+        || (offset - text_start) % RECORD_SIZE != 0
+        || (first && (pos != 0 || offset != text_start))
+        || (!first && (pos < input->index[2 * i - 2] || offset <= input->index[2 * i - 1]))) {
+      die("corrupt indexed file");
+    }
+  }
+  uint64_t sum = 0;
+  uint64_t entry = 0;
+  for (uint64_t offset = text_start; offset < text_start + input->size; offset += RECORD_SIZE) {
+    if (entry < input->num_entries && input->index[2 * entry + 1] == offset) {
+      if (input->index[2 * entry] != sum) {
+        die("corrupt indexed file");
       }
+      entry++;
     }
+    int count;
+    memcpy(&count, input->map + offset, sizeof(int));
+    sum += count > 0 ? count : 0;
   }
+  if (entry != input->num_entries || sum != input->uncompressed) {
+    die("corrupt indexed file");
+  }
+}
+
+void print_usage() {
+  printf("wunzip: file1 [file2 ...]\n");
+  exit(1);
 }
 
+int main(int argc, char **argv) {
+  size_t range_start = 0;
+  size_t range_end = SIZE_MAX;
+  bool has_range = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:t:")) != -1) {
+    switch (opt) {
+    case 'r': {
+      // start:end, or start: for everything from start on
+      char *end;
+      range_start = strtoull(optarg, &end, 10);
+      if (*end != ':') {
+        die("range must look like start:end");
+      }
+      if (end[1] != '\0') {
+        range_end = strtoull(end + 1, &end, 10);
+      }
+      if (*end != '\0' && *end != ':') {
+        die("range must look like start:end");
+      }
+      has_range = true;
+      break;
+    }
+    case 't':
+      num_threads = atoi(optarg);
+      if (num_threads <= 0) {
+        die("thread count must be positive");
+      }
+      break;
+    default:
+      print_usage();
+    }
+  }
+  if (optind >= argc) {
+    print_usage();
+  }
+
+  // regular files get mapped. if anything else is in the list ("-" for
+  // stdin, a pipe, a device) the whole list is streamed instead.
+  for (int i = optind; i < argc; i++) {
+    struct stat statbuf;
+    if (strcmp(argv[i], "-") == 0 || (stat(argv[i], &statbuf) == 0 && !S_ISREG(statbuf.st_mode))) {
+      decode_stream(argv + optind, argc - optind, range_start, range_end);
+      return 0;
+    }
+  }
+
+  int num_files = argc - optind;
+  input_t *files = (input_t *) malloc_or_die(sizeof(input_t) * num_files);
+  bool all_indexed = true;
+  bool any_without_records = false;
+  for (int i = 0; i < num_files; i++) {
+    input_open(&files[i], argv[optind + i]);
+    all_indexed = all_indexed && files[i].indexed;
+    any_without_records = any_without_records || files[i].entropy_coded || files[i].compact;
+  }
+  if (range_start >= range_end) {
+    return 0;
+  }
+
+  if (has_range && all_indexed) {
+    inputs = files;
+    num_inputs = num_files;
+    decode_indexed_range(range_start, range_end);
+    return 0;
+  }
+
+  if (num_threads == 0) {
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_threads < 1) {
+    num_threads = DEFAULT_NUM_THREADS;
+  }
+  thread_args_t *thread_args = (thread_args_t *) malloc_or_die(sizeof(thread_args_t) * num_threads);
+
+  // record files are normally all decoded together. entropy coded and
+  // compact files don't have records, so if there are any, go one file at a time.
+  int group_size = any_without_records ? 1 : num_files;
+  size_t base = 0; // output offset of the first byte of this group
+  for (int i = 0; i < num_files && base < range_end; i += group_size) {
+    size_t start = range_start > base ? range_start - base : 0;
+    size_t end = range_end - base;
+    if (files[i].entropy_coded) {
+      base += decode_entropy_coded(thread_args, &files[i], start, end);
+      continue;
+    }
+    if (files[i].compact) {
+      base += decode_compact(&files[i], start, end);
+      continue;
+    }
+    inputs = &files[i];
+    num_inputs = group_size;
+    num_records = 0;
+    for (int j = 0; j < num_inputs; j++) {
+      inputs[j].first_record = num_records;
+      // a truncated trailing record is ignored
+      num_records += inputs[j].size / RECORD_SIZE;
+    }
+    base += decode_records(thread_args, start, end);
+  }
+
+  for (int i = 0; i < num_files; i++) {
+    if (files[i].map != NULL) {
+      munmap(files[i].map, files[i].map_size);
+    }
+    if (files[i].entropy_coded) {
+      free(files[i].blocks);
+    }
+    if (files[i].indexed) {
+      free(files[i].index);
+    }
+  }
+  free(thread_args);
+  free(files);
+  return 0;
+}